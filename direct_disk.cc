@@ -0,0 +1,119 @@
+#include "direct_disk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+Direct_Disk::Direct_Disk(const char *filename, int n, int b)
+{
+	blocksize = b;
+	bounces = 0;
+	direct = true;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_DIRECT, 0644);
+	if (fd < 0 && errno == EINVAL)
+	{
+		cout << "WARNING: " << filename << " doesn't support O_DIRECT, using buffered I/O\n";
+		direct = false;
+		fd = open(filename, O_RDWR | O_CREAT, 0644);
+	}
+	if (fd < 0)
+	{
+		cout << "Error when opening the file " << filename << "\n";
+		return;
+	}
+
+	ftruncate(fd, (off_t)n * blocksize);
+	nblocks = n;
+}
+
+Direct_Disk::~Direct_Disk()
+{
+	close();
+	for (std::size_t i = 0; i < bounce_free.size(); i++)
+	{
+		delete bounce_free[i];
+	}
+}
+
+Disk::run_buffer *Direct_Disk::bounce_get()
+{
+	std::lock_guard<std::mutex> guard(bounce_mutex);
+	if (bounce_free.empty())
+	{
+		return new Disk::run_buffer;
+	}
+	Disk::run_buffer *b = bounce_free.back();
+	bounce_free.pop_back();
+	return b;
+}
+
+void Direct_Disk::bounce_put(Disk::run_buffer *b, std::size_t bytes)
+{
+	if (bytes > (std::size_t)BOUNCE_KEEP_BYTES)
+	{
+		delete b;
+		return;
+	}
+	std::lock_guard<std::mutex> guard(bounce_mutex);
+	bounce_free.push_back(b);
+}
+
+int Direct_Disk::do_read(int blocknum, int count, char *data)
+{
+	ssize_t bytes = (ssize_t)count * blocksize;
+	off_t offset = (off_t)blocknum * blocksize;
+	if ((uintptr_t)data % BUFFER_ALIGN == 0)
+	{
+		return pread(fd, data, bytes, offset) == bytes;
+	}
+
+	Disk::run_buffer *b = bounce_get();
+	char *bounce = b->get(bytes);
+	int ok = pread(fd, bounce, bytes, offset) == bytes;
+	memcpy(data, bounce, bytes);
+	bounce_put(b, bytes);
+	bounces++;
+	return ok;
+}
+
+int Direct_Disk::do_write(int blocknum, int count, const char *data)
+{
+	ssize_t bytes = (ssize_t)count * blocksize;
+	off_t offset = (off_t)blocknum * blocksize;
+	if ((uintptr_t)data % BUFFER_ALIGN == 0)
+	{
+		return pwrite(fd, data, bytes, offset) == bytes;
+	}
+
+	Disk::run_buffer *b = bounce_get();
+	char *bounce = b->get(bytes);
+	memcpy(bounce, data, bytes);
+	int ok = pwrite(fd, bounce, bytes, offset) == bytes;
+	bounce_put(b, bytes);
+	bounces++;
+	return ok;
+}
+
+int Direct_Disk::do_zero(int blocknum, int count)
+{
+	return zero_range(fd, (off_t)blocknum * blocksize, (off_t)count * blocksize);
+}
+
+void Direct_Disk::close()
+{
+	trace_close();
+	if (fd < 0)
+		return;
+
+	cout << nreads << " disk block reads\n";
+	cout << nwrites << " disk block writes\n";
+	if (direct)
+		cout << bounces << " unaligned requests copied through a bounce buffer\n";
+	report_stats();
+	::close(fd);
+	fd = -1;
+}
@@ -0,0 +1,41 @@
+#ifndef DIRECT_DISK_H
+#define DIRECT_DISK_H
+
+#include "disk.h"
+
+// Disco cuja imagem é aberta com O_DIRECT: as transferências vão do buffer
+// do chamador direto para o dispositivo, sem passar pelo cache de páginas.
+// O_DIRECT exige buffers alinhados; os do pool do disco e os run_buffer já
+// são, e os demais passam por um buffer alinhado intermediário (contados em
+// "bounces"), reaproveitado entre as requisições.
+// Se o sistema de arquivos do hospedeiro não aceitar O_DIRECT (tmpfs, por
+// exemplo), a imagem é aberta normalmente.
+class Direct_Disk : public Disk
+{
+public:
+    // Buffers intermediários maiores que isto não são guardados para reúso
+    static const int BOUNCE_KEEP_BYTES = 1024 * 1024;
+
+    Direct_Disk(const char *filename, int nblocks, int block_size = DISK_BLOCK_SIZE);
+    ~Direct_Disk();
+
+    void close();
+
+protected:
+    int do_read(int blocknum, int count, char *data);
+    int do_write(int blocknum, int count, const char *data);
+    int do_zero(int blocknum, int count);
+
+private:
+    Disk::run_buffer *bounce_get();
+    void bounce_put(Disk::run_buffer *b, std::size_t bytes);
+
+    int fd;
+    bool direct;
+    std::atomic<long> bounces;
+    // Buffers intermediários livres, um por requisição em andamento no máximo
+    std::mutex bounce_mutex;
+    std::vector<Disk::run_buffer *> bounce_free;
+};
+
+#endif
@@ -1,8 +1,18 @@
 #include "disk.h"
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-Disk::Disk(const char *filename, int n)
+const Disk::service_model Disk::HDD = {"hdd", 0.1, 0.5, 15.0, 8.33, 150.0};
+const Disk::service_model Disk::SSD = {"ssd", 0.05, 0.0, 0.0, 0.0, 500.0};
+
+Disk::Disk(const char *filename, int n, int b)
 {
+	blocksize = b;
+
 	diskfile = fopen(filename, "r+");
 
 	if (!diskfile)
@@ -14,19 +24,39 @@ Disk::Disk(const char *filename, int n)
 		return;
 	}
 
-	ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+	// Deslocamentos em bytes são de 64 bits: a imagem pode passar de 2 GiB
+	ftruncate(fileno(diskfile), (off_t)n * blocksize);
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
 }
 
+Disk::Disk()
+{
+	diskfile = 0;
+	nblocks = 0;
+	blocksize = DISK_BLOCK_SIZE;
+	nreads = 0;
+	nwrites = 0;
+}
+
+Disk::~Disk()
+{
+	free(arena);
+}
+
 int Disk::size()
 {
 	return nblocks;
 }
 
-void Disk::sanity_check(int blocknum, const void *data)
+int Disk::block_size()
+{
+	return blocksize;
+}
+
+void Disk::sanity_check(int blocknum, int count, const void *data)
 {
 	if (blocknum < 0)
 	{
@@ -34,9 +64,9 @@ void Disk::sanity_check(int blocknum, const void *data)
 		abort();
 	}
 
-	if (blocknum >= nblocks)
+	if (count <= 0 || (long)blocknum + count > nblocks)
 	{
-		cout << "ERROR: blocknum (" << blocknum << ") is too big!\n";
+		cout << "ERROR: blocknum (" << blocknum + count - 1 << ") is too big!\n";
 		abort();
 	}
 
@@ -47,15 +77,25 @@ void Disk::sanity_check(int blocknum, const void *data)
 	}
 }
 
-void Disk::read(int blocknum, char *data)
+void Disk::read(int blocknum, char *data, int context)
 {
-	sanity_check(blocknum, data);
+	read_blocks(blocknum, 1, data, context);
+}
+
+void Disk::write(int blocknum, const char *data, int context)
+{
+	write_blocks(blocknum, 1, data, context);
+}
 
-	fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+void Disk::read_blocks(int blocknum, int count, char *data, int context)
+{
+	sanity_check(blocknum, count, data);
+	trace(OP_READ, blocknum, count, context);
 
-	if (fread(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+	if (do_read(blocknum, count, data))
 	{
-		nreads++;
+		nreads += count;
+		charge(blocknum, count);
 	}
 	else
 	{
@@ -64,15 +104,15 @@ void Disk::read(int blocknum, char *data)
 	}
 }
 
-void Disk::write(int blocknum, const char *data)
+void Disk::write_blocks(int blocknum, int count, const char *data, int context)
 {
-	sanity_check(blocknum, data);
-
-	fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+	sanity_check(blocknum, count, data);
+	trace(OP_WRITE, blocknum, count, context);
 
-	if (fwrite(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+	if (do_write(blocknum, count, data))
 	{
-		nwrites++;
+		nwrites += count;
+		charge(blocknum, count);
 	}
 	else
 	{
@@ -81,12 +121,212 @@ void Disk::write(int blocknum, const char *data)
 	}
 }
 
+// pread/pwrite não dependem da posição corrente do arquivo, de modo que
+// várias threads podem acessar o disco ao mesmo tempo
+int Disk::do_read(int blocknum, int count, char *data)
+{
+	ssize_t bytes = (ssize_t)count * blocksize;
+	return pread(fileno(diskfile), data, bytes, (off_t)blocknum * blocksize) == bytes;
+}
+
+int Disk::do_write(int blocknum, int count, const char *data)
+{
+	ssize_t bytes = (ssize_t)count * blocksize;
+	return pwrite(fileno(diskfile), data, bytes, (off_t)blocknum * blocksize) == bytes;
+}
+
+int Disk::zero_blocks(int blocknum, int count)
+{
+	if (blocknum < 0 || count <= 0 || (long)blocknum + count > nblocks)
+		return 0;
+	return do_zero(blocknum, count);
+}
+
+int Disk::do_zero(int blocknum, int count)
+{
+	return zero_range(fileno(diskfile), (off_t)blocknum * blocksize, (off_t)count * blocksize);
+}
+
+// ZERO_RANGE mantém o espaço alocado; onde não existe (tmpfs, ext3), o trecho
+// vira um buraco na imagem, que também é lido como zeros.
+int Disk::zero_range(int fd, off_t offset, off_t length)
+{
+	return fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0 ||
+		   fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+}
+
+int Disk::trace_open(const char *filename)
+{
+	std::lock_guard<std::mutex> guard(trace_mutex);
+	if (tracefile)
+		fclose(tracefile);
+
+	tracefile = fopen(filename, "w");
+	if (!tracefile)
+	{
+		cout << "ERROR: couldn't open trace file " << filename << "\n";
+		return 0;
+	}
+
+	trace_header header;
+	header.magic = TRACE_MAGIC;
+	header.block_size = blocksize;
+	header.nblocks = nblocks;
+	fwrite(&header, sizeof(header), 1, tracefile);
+	trace_start = std::chrono::steady_clock::now();
+	return 1;
+}
+
+void Disk::trace_close()
+{
+	std::lock_guard<std::mutex> guard(trace_mutex);
+	if (tracefile)
+	{
+		fclose(tracefile);
+		tracefile = 0;
+	}
+}
+
+// Requisições de mais de 65535 blocos ocupam vários registros
+void Disk::trace(int op, int blocknum, int count, int context)
+{
+	std::lock_guard<std::mutex> guard(trace_mutex);
+	if (!tracefile)
+		return;
+
+	trace_record record;
+	record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_start).count();
+	record.op = op;
+	record.context = context;
+	while (count > 0)
+	{
+		record.block = blocknum;
+		record.count = std::min(count, 65535);
+		fwrite(&record, sizeof(record), 1, tracefile);
+		blocknum += record.count;
+		count -= record.count;
+	}
+}
+
+char *Disk::buffer_get()
+{
+	std::lock_guard<std::mutex> guard(pool_mutex);
+
+	// A arena é criada no primeiro uso, quando o tamanho de bloco já é conhecido
+	if (!arena)
+	{
+		if (posix_memalign((void **)&arena, BUFFER_ALIGN, (std::size_t)POOL_BUFFERS * blocksize) != 0)
+		{
+			cout << "ERROR: couldn't allocate the block buffer pool\n";
+			abort();
+		}
+		for (int i = POOL_BUFFERS - 1; i >= 0; i--)
+		{
+			char *b = arena + (std::size_t)i * blocksize;
+			*(char **)b = free_buffers;
+			free_buffers = b;
+		}
+	}
+
+	if (free_buffers)
+	{
+		char *b = free_buffers;
+		free_buffers = *(char **)b;
+		return b;
+	}
+
+	char *b;
+	if (posix_memalign((void **)&b, BUFFER_ALIGN, blocksize) != 0)
+	{
+		cout << "ERROR: couldn't allocate a block buffer\n";
+		abort();
+	}
+	pool_overflows++;
+	return b;
+}
+
+void Disk::buffer_put(char *b)
+{
+	std::lock_guard<std::mutex> guard(pool_mutex);
+	if (b >= arena && b < arena + (std::size_t)POOL_BUFFERS * blocksize)
+	{
+		*(char **)b = free_buffers;
+		free_buffers = b;
+	}
+	else
+	{
+		free(b);
+	}
+}
+
+const Disk::service_model *Disk::find_model(const char *name)
+{
+	if (!strcmp(name, HDD.name))
+		return &HDD;
+	if (!strcmp(name, SSD.name))
+		return &SSD;
+	return 0;
+}
+
+void Disk::set_model(const service_model &m)
+{
+	std::lock_guard<std::mutex> guard(model_mutex);
+	model = &m;
+	head = 0;
+	model_ms = 0;
+}
+
+double Disk::modeled_ms()
+{
+	std::lock_guard<std::mutex> guard(model_mutex);
+	return model_ms;
+}
+
+// Uma requisição que começa onde a anterior terminou não paga seek nem rotação
+void Disk::charge(int blocknum, int count)
+{
+	std::lock_guard<std::mutex> guard(model_mutex);
+	if (!model)
+		return;
+
+	double ms = model->overhead_ms;
+	int distance = std::abs(blocknum - head);
+	if (distance > 0)
+	{
+		ms += model->seek_min_ms + (model->seek_max_ms - model->seek_min_ms) * std::sqrt((double)distance / nblocks);
+		ms += model->rotation_ms / 2;
+	}
+	ms += (double)count * blocksize / (model->transfer_mb_s * 1024 * 1024) * 1000;
+
+	model_ms += ms;
+	head = blocknum + count;
+}
+
+void Disk::report_stats()
+{
+	{
+		std::lock_guard<std::mutex> guard(model_mutex);
+		if (model)
+			cout << model_ms << " ms of modeled disk time (" << model->name << ")\n";
+	}
+	std::lock_guard<std::mutex> guard(pool_mutex);
+	if (pool_overflows)
+		cout << pool_overflows << " block buffers allocated beyond the pool\n";
+}
+
+// As escritas de um Disk vão direto para a imagem
+void Disk::flush()
+{
+}
+
 void Disk::close()
 {
+	trace_close();
 	if (diskfile)
 	{
 		cout << nreads << " disk block reads\n";
 		cout << nwrites << " disk block writes\n";
+		report_stats();
 		fclose(diskfile);
 		diskfile = 0;
 	}
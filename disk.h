@@ -1,9 +1,15 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
 #include <vector>
 
 using namespace std;
@@ -13,23 +19,191 @@ class Disk
 public:
     static const unsigned short int DISK_BLOCK_SIZE = 4096;
     static const unsigned int DISK_MAGIC = 0xdeadbeef;
+    static const unsigned int TRACE_MAGIC = 0x53465452;
+
+    // Origem de uma requisição, informada pelo sistema de arquivos e registrada no trace
+    static const int IO_SUPER = 0;
+    static const int IO_INODE = 1;
+    static const int IO_INDIRECT = 2;
+    static const int IO_DATA = 3;
+
+    static const int OP_READ = 0;
+    static const int OP_WRITE = 1;
+
+    // Um arquivo de trace é um trace_header seguido de um trace_record por requisição
+    class trace_header
+    {
+    public:
+        uint32_t magic;
+        uint32_t block_size;
+        uint32_t nblocks;
+    };
+
+    class trace_record
+    {
+    public:
+        // Nanossegundos desde a abertura do trace
+        uint64_t time;
+        uint32_t block;
+        uint16_t count;
+        uint8_t op;
+        uint8_t context;
+    };
+
+    // Modelo de tempo de serviço: cada requisição custa um tempo fixo, mais seek e
+    // latência rotacional quando não continua a partir da posição da cabeça, mais a
+    // transferência. O seek cresce com a raiz quadrada da distância percorrida.
+    class service_model
+    {
+    public:
+        const char *name;
+        double overhead_ms;
+        double seek_min_ms;
+        double seek_max_ms;
+        double rotation_ms;
+        double transfer_mb_s;
+    };
+
+    // Disco de 7200 rpm e SSD SATA
+    static const service_model HDD;
+    static const service_model SSD;
+    // Retorna o modelo com o nome indicado ("hdd", "ssd"), ou 0
+    static const service_model *find_model(const char *name);
+
+    // Alinhamento dos buffers do pool, exigido por Direct_Disk
+    static const int BUFFER_ALIGN = 4096;
+    // Número de buffers pré-alocados no pool de cada disco
+    static const int POOL_BUFFERS = 64;
+
+    // Buffer de um bloco emprestado do pool do disco e devolvido ao sair do escopo
+    class buffer
+    {
+    public:
+        buffer(Disk *d)
+        {
+            disk = d;
+            data = d->buffer_get();
+        }
+        ~buffer()
+        {
+            disk->buffer_put(data);
+        }
+        char *data;
+
+    private:
+        Disk *disk;
+        buffer(const buffer &);
+        buffer &operator=(const buffer &);
+    };
+
+    // Buffer alinhado de vários blocos, para as transferências maiores que um
+    // bloco (sequências de blocos, zeros): cresce sob demanda, sem preservar o
+    // conteúdo, e é liberado ao sair do escopo
+    class run_buffer
+    {
+    public:
+        run_buffer() : data(0), capacity(0) {}
+        ~run_buffer()
+        {
+            free(data);
+        }
+        char *get(std::size_t bytes)
+        {
+            if (bytes > capacity)
+            {
+                free(data);
+                data = 0;
+                capacity = 0;
+                if (posix_memalign((void **)&data, BUFFER_ALIGN, bytes) != 0)
+                {
+                    cout << "ERROR: couldn't allocate a block buffer\n";
+                    abort();
+                }
+                capacity = bytes;
+            }
+            return data;
+        }
+
+    private:
+        char *data;
+        std::size_t capacity;
+        run_buffer(const run_buffer &);
+        run_buffer &operator=(const run_buffer &);
+    };
+
     std::vector<bool> bitmap;
 
-    Disk(const char *filename, int nblocks);
+    Disk(const char *filename, int nblocks, int block_size = DISK_BLOCK_SIZE);
+    virtual ~Disk();
 
     int size();
-    void read(int blocknum, char *data);
-    void write(int blocknum, const char *data);
-    void close();
+    int block_size();
+    void read(int blocknum, char *data, int context = IO_DATA);
+    void write(int blocknum, const char *data, int context = IO_DATA);
+    // Transferem "count" blocos consecutivos a partir de "blocknum" em uma única requisição
+    void read_blocks(int blocknum, int count, char *data, int context = IO_DATA);
+    void write_blocks(int blocknum, int count, const char *data, int context = IO_DATA);
+    // Leva ao meio de armazenamento as escritas retidas em memória pelo disco
+    virtual void flush();
+    virtual void close();
 
-private:
-    void sanity_check(int blocknum, const void *data);
+    // Zera os blocos [blocknum, blocknum + count) sem transferi-los, pedindo ao
+    // hospedeiro que descarte o conteúdo (fallocate). Não entra no trace nem nas
+    // contagens. Retorna 0 se o meio de armazenamento não permitir.
+    int zero_blocks(int blocknum, int count);
+
+    // Passa a registrar cada requisição no arquivo indicado. Retorna 1 em caso de sucesso.
+    int trace_open(const char *filename);
+    void trace_close();
+
+    // Pool de buffers de um bloco, alinhados à página: uma arena pré-alocada com
+    // POOL_BUFFERS blocos e uma lista de livres. Com a arena esgotada, os buffers
+    // extras vêm do heap e são liberados na devolução.
+    char *buffer_get();
+    void buffer_put(char *data);
+
+    // Passa a contabilizar o tempo simulado de cada requisição segundo o modelo
+    void set_model(const service_model &model);
+    // Tempo simulado acumulado, em milissegundos
+    double modeled_ms();
+
+protected:
+    Disk();
+    // Executam a transferência no meio de armazenamento; retornam 1 em caso de sucesso
+    virtual int do_read(int blocknum, int count, char *data);
+    virtual int do_write(int blocknum, int count, const char *data);
+    virtual int do_zero(int blocknum, int count);
+    // Zera um trecho do arquivo aberto em fd; retorna 1 em caso de sucesso
+    static int zero_range(int fd, off_t offset, off_t length);
 
 private:
+    void sanity_check(int blocknum, int count, const void *data);
+    void trace(int op, int blocknum, int count, int context);
+
+    FILE *tracefile = 0;
+    std::mutex trace_mutex;
+    std::chrono::steady_clock::time_point trace_start;
+
+    void charge(int blocknum, int count);
+
+    char *arena = 0;
+    char *free_buffers = 0;
+    std::mutex pool_mutex;
+    int pool_overflows = 0;
+
+    const service_model *model = 0;
+    std::mutex model_mutex;
+    int head = 0;
+    double model_ms = 0;
+
+protected:
+    void report_stats();
+
     FILE *diskfile;
     int nblocks;
-    int nreads;
-    int nwrites;
+    int blocksize;
+    std::atomic<int> nreads;
+    std::atomic<int> nwrites;
 };
 
 #endif
@@ -0,0 +1,212 @@
+#include "elevator_disk.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+Elevator_Disk::Elevator_Disk(Disk *b, int d, int deadline)
+{
+	backend = b;
+	depth = d > 0 ? d : DEFAULT_DEPTH;
+	deadline_ms = deadline;
+	nblocks = backend->size();
+	blocksize = backend->block_size();
+
+	// Alinhado, para que um Direct_Disk não precise copiar
+	merge_blocks = std::max(1, MERGE_BYTES / blocksize);
+	if (posix_memalign((void **)&run, BUFFER_ALIGN, (std::size_t)merge_blocks * blocksize) != 0)
+	{
+		// Sem o buffer, cada bloco é despachado sozinho a partir da fila
+		run = 0;
+		merge_blocks = 1;
+	}
+}
+
+Elevator_Disk::~Elevator_Disk()
+{
+	close();
+	delete backend;
+	free(run);
+}
+
+int Elevator_Disk::do_read(int blocknum, int count, char *data)
+{
+	// Copia os blocos que ainda estão na fila: eles são mais novos que os do backend
+	std::vector<int> queued;
+	std::vector<char> overlay;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		if (expired())
+		{
+			dispatch();
+		}
+		for (std::map<int, request>::iterator it = pending.lower_bound(blocknum); it != pending.end() && it->first < blocknum + count; ++it)
+		{
+			queued.push_back(it->first);
+			overlay.insert(overlay.end(), it->second.data.begin(), it->second.data.end());
+		}
+		read_hits += queued.size();
+	}
+
+	// Um pedido inteiramente na fila nem chega ao backend
+	if ((int)queued.size() < count)
+	{
+		backend->read_blocks(blocknum, count, data);
+	}
+	for (std::size_t i = 0; i < queued.size(); i++)
+	{
+		memcpy(data + (std::size_t)(queued[i] - blocknum) * blocksize, overlay.data() + i * blocksize, blocksize);
+	}
+	return 1;
+}
+
+int Elevator_Disk::do_write(int blocknum, int count, const char *data)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (pending.empty())
+	{
+		oldest = now;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		request &r = pending[blocknum + i];
+		if (r.data.empty())
+		{
+			r.queued = now;
+		}
+		else
+		{
+			// A escrita anterior do bloco nunca chega ao backend
+			absorbed_blocks++;
+		}
+		const char *block = data + (std::size_t)i * blocksize;
+		r.data.assign(block, block + blocksize);
+	}
+
+	queued_requests++;
+	queued_blocks += count;
+	max_depth = std::max(max_depth, (int)pending.size());
+	depth_sum += pending.size();
+
+	if ((int)pending.size() >= depth || expired())
+	{
+		dispatch();
+	}
+	return 1;
+}
+
+// Os blocos zerados deixam de ter escritas pendentes.
+int Elevator_Disk::do_zero(int blocknum, int count)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	pending.erase(pending.lower_bound(blocknum), pending.lower_bound(blocknum + count));
+	return backend->zero_blocks(blocknum, count);
+}
+
+// A escrita mais antiga da fila já esperou mais que o prazo. Chamada com a trava.
+bool Elevator_Disk::expired()
+{
+	if (pending.empty())
+		return false;
+	std::chrono::duration<double, std::milli> age = std::chrono::steady_clock::now() - oldest;
+	return age.count() >= deadline_ms;
+}
+
+// Despacha a fila inteira em ordem de elevador. Chamada com a trava.
+void Elevator_Disk::dispatch()
+{
+	std::vector<std::map<int, request>::iterator> order;
+	std::map<int, request>::iterator start = pending.lower_bound(head);
+	for (std::map<int, request>::iterator it = start; it != pending.end(); ++it)
+	{
+		order.push_back(it);
+	}
+	for (std::map<int, request>::iterator it = pending.begin(); it != start; ++it)
+	{
+		order.push_back(it);
+	}
+
+	for (std::size_t i = 0; i < order.size();)
+	{
+		// Sequência de blocos consecutivos a partir de order[i]
+		std::size_t n = 1;
+		while (i + n < order.size() && (int)n < merge_blocks && order[i + n]->first == order[i]->first + (int)n)
+		{
+			n++;
+		}
+		dispatch_run(order[i], n);
+		i += n;
+	}
+	pending.clear();
+}
+
+// Escreve no backend "count" blocos consecutivos da fila a partir de "first".
+void Elevator_Disk::dispatch_run(std::map<int, request>::iterator first, int count)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::map<int, request>::iterator it = first;
+	for (int i = 0; i < count; i++, ++it)
+	{
+		std::chrono::duration<double, std::milli> wait = now - it->second.queued;
+		wait_ms += wait.count();
+		max_wait_ms = std::max(max_wait_ms, wait.count());
+		if (run)
+		{
+			memcpy(run + (std::size_t)i * blocksize, it->second.data.data(), blocksize);
+		}
+	}
+
+	backend->write_blocks(first->first, count, run ? run : first->second.data.data());
+	dispatched_requests++;
+	dispatched_blocks += count;
+	head = first->first + count;
+}
+
+void Elevator_Disk::flush()
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		if (!pending.empty())
+		{
+			dispatch();
+		}
+	}
+	backend->flush();
+}
+
+int Elevator_Disk::queue_depth()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return pending.size();
+}
+
+double Elevator_Disk::merge_ratio()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return dispatched_requests ? (double)queued_requests / dispatched_requests : 0.0;
+}
+
+double Elevator_Disk::average_wait_ms()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return dispatched_blocks ? wait_ms / dispatched_blocks : 0.0;
+}
+
+void Elevator_Disk::close()
+{
+	if (closed)
+		return;
+	flush();
+	trace_close();
+
+	cout << queued_requests << " write requests queued (" << queued_blocks << " blocks, " << absorbed_blocks
+		 << " overwritten while queued), " << read_hits << " blocks read from the queue\n";
+	cout << dispatched_requests << " write requests dispatched, merge ratio " << merge_ratio() << ", queue depth "
+		 << (queued_requests ? depth_sum / queued_requests : 0.0) << " average, " << max_depth << " max\n";
+	cout << average_wait_ms() << " ms average wait, " << max_wait_ms << " ms max\n";
+	report_stats();
+	backend->close();
+	closed = true;
+}
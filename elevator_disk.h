@@ -0,0 +1,82 @@
+#ifndef ELEVATOR_DISK_H
+#define ELEVATOR_DISK_H
+
+#include "disk.h"
+
+#include <map>
+
+// Fila de requisições na frente de outro disco (o "backend").
+// As escritas ficam retidas na fila, ordenadas pelo número do bloco; uma nova
+// escrita de um bloco que ainda está na fila substitui a anterior. A fila é
+// despachada quando atinge "depth" blocos, quando a escrita mais antiga passa
+// de "deadline_ms" (verificado a cada requisição), em flush() e em close().
+// O despacho segue o elevador circular (C-LOOK): a partir da última posição
+// da cabeça em ordem crescente, e depois do início, com os blocos consecutivos
+// reunidos em uma única escrita de até MERGE_BYTES.
+// As leituras vão direto ao backend, mas enxergam as escritas ainda na fila.
+class Elevator_Disk : public Disk
+{
+public:
+    static const int DEFAULT_DEPTH = 128;
+    static const int DEFAULT_DEADLINE_MS = 50;
+    static const int MERGE_BYTES = 1024 * 1024;
+
+    // O Elevator_Disk passa a ser o dono de "backend"
+    Elevator_Disk(Disk *backend, int depth = DEFAULT_DEPTH, int deadline_ms = DEFAULT_DEADLINE_MS);
+    ~Elevator_Disk();
+
+    void flush();
+    void close();
+
+    // Blocos na fila agora
+    int queue_depth();
+    // Requisições de escrita recebidas por requisição despachada ao backend
+    double merge_ratio();
+    // Tempo médio de espera na fila de cada bloco despachado, em milissegundos
+    double average_wait_ms();
+
+protected:
+    int do_read(int blocknum, int count, char *data);
+    int do_write(int blocknum, int count, const char *data);
+    int do_zero(int blocknum, int count);
+
+private:
+    class request
+    {
+    public:
+        std::vector<char> data;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void dispatch();
+    void dispatch_run(std::map<int, request>::iterator first, int count);
+    bool expired();
+
+    Disk *backend;
+    int depth;
+    int deadline_ms;
+    int merge_blocks;
+    // Buffer alinhado em que uma sequência de blocos é montada para o despacho
+    char *run;
+
+    // Protege a fila e as estatísticas; o despacho acontece com ela travada
+    std::mutex mutex;
+    std::map<int, request> pending;
+    // Chegada da escrita mais antiga da fila
+    std::chrono::steady_clock::time_point oldest;
+    int head = 0;
+    bool closed = false;
+
+    long queued_requests = 0;
+    long queued_blocks = 0;
+    long absorbed_blocks = 0;
+    long dispatched_requests = 0;
+    long dispatched_blocks = 0;
+    long read_hits = 0;
+    int max_depth = 0;
+    double depth_sum = 0;
+    double wait_ms = 0;
+    double max_wait_ms = 0;
+};
+
+#endif
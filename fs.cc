@@ -1,6 +1,8 @@
 #include "fs.h"
+#include <algorithm>
 #include <cmath>
 #include <cstring>
+#include <stdlib.h>
 
 // Cria um novo sistema de arquivos no disco, destruindo qualquer dado que estiver presente.
 // Reserva dez por cento dos blocos para inodos, libera a tabela de inodos, e escreve o superbloco.
@@ -9,11 +11,52 @@
 // Também, uma tentativa de formatar um disco que já foi montado não deve fazer nada e retornar falha.
 // A rotina de formatação é responsável por escolher ninodeblocks:
 // isto deve ser sempre 10 por cento de nblocks, arredondando pra cima.
-// Note que a estrutura de dados do superbloco é pequena: apenas 16 bytes.
-// O restante do bloco zero de disco é deixado sem ser usado.
+// Note que a estrutura de dados do superbloco é pequena: apenas 36 bytes
+// (os cinco últimos campos registram o tamanho de bloco, o tamanho dos grupos,
+// quantos blocos de inodos a formatação rápida deixou por zerar, o tamanho dos
+// segmentos do modo de log e a largura dos ponteiros de bloco).
+// O restante do bloco zero de disco é zerado.
 // A rotina de formatação coloca este número (FS_MAGIC) nos primeiros bytes do
 // superbloco como um tipo de “assinatura” do sistema de arquivos.
-int INE5412_FS::fs_format()
+template <class G>
+int INE5412_FS_Impl<G>::fs_format()
+{
+	return fs_format_groups(0);
+}
+
+// Formata o disco dividido em grupos de group_blocks blocos, no estilo do ext2.
+// Cada grupo começa pela sua fatia da tabela de inodos (dez por cento dos blocos
+// do grupo) e os dados dos arquivos são alocados, de preferência, no grupo do
+// inodo. O último grupo absorve os blocos que sobram da divisão.
+// Com group_blocks igual a zero, usa o formato original, com todos os inodos no início.
+template <class G>
+int INE5412_FS_Impl<G>::fs_format_groups(int group_blocks)
+{
+	return format(group_blocks, false, false);
+}
+
+// Formatação rápida, no estilo do lazy_itable_init do ext4: em vez de escrever
+// cada bloco da tabela de inodos, pede ao hospedeiro que zere a região inteira
+// (fallocate). Se o disco não permitir, os blocos ficam marcados como não
+// inicializados no superbloco e são zerados depois da montagem.
+// Em ambos os casos o custo não depende do tamanho do disco.
+template <class G>
+int INE5412_FS_Impl<G>::fs_format_lazy(int group_blocks)
+{
+	return format(group_blocks, true, false);
+}
+
+// Formata no modo de log. O número de inodos é o mesmo da formatação normal,
+// mas a tabela de inodos não tem lugar fixo: só os dois checkpoints ficam
+// reservados no início do disco e todo o resto pertence ao log.
+template <class G>
+int INE5412_FS_Impl<G>::fs_format_log()
+{
+	return format(0, false, true);
+}
+
+template <class G>
+int INE5412_FS_Impl<G>::format(int group_blocks, bool lazy, bool log)
 {
 	// verifica se o disco já está montado
 	if (is_mounted)
@@ -27,7 +70,20 @@ int INE5412_FS::fs_format()
 	int disk_size = disk->size();
 	int n_inodes = std::ceil(disk_size * 0.1);
 
-	union fs_block fs_superblock;
+	if (group_blocks != 0)
+	{
+		int group_inodes = std::ceil(group_blocks * 0.1);
+		if (group_blocks < 0 || group_blocks <= group_inodes || group_blocks > disk_size - 1)
+		{
+			cout << "ERROR: tamanho de grupo inválido: " << group_blocks << "\n";
+			return 0;
+		}
+		n_inodes = (disk_size - 1) / group_blocks * group_inodes;
+	}
+
+	pooled_block fs_superblock_buffer(disk);
+	fs_block &fs_superblock = *fs_superblock_buffer;
+	memset(fs_superblock.data, 0, BLOCK_SIZE);
 	fs_superblock.super.magic = FS_MAGIC;
 	// numero total de blocos
 	fs_superblock.super.nblocks = disk_size;
@@ -35,13 +91,57 @@ int INE5412_FS::fs_format()
 	fs_superblock.super.ninodeblocks = n_inodes;
 	// numero de inodes nesses blocos
 	fs_superblock.super.ninodes = INODES_PER_BLOCK * n_inodes;
+	// tamanho de bloco, conferido na montagem
+	fs_superblock.super.block_size = BLOCK_SIZE;
+	fs_superblock.super.group_blocks = group_blocks;
+	fs_superblock.super.pointer_bytes = sizeof(int);
+
+	if (log)
+	{
+		// Segmentos de SEGMENT_BYTES, mas pelo menos oito no disco
+		imap_blocks = (n_inodes + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+		int log_blocks = disk_size - log_start();
+		if (log_blocks < 8)
+		{
+			cout << "ERROR: disco pequeno demais para o modo de log\n";
+			return 0;
+		}
+		fs_superblock.super.segment_blocks = std::max(1, std::min(SEGMENT_BYTES / BLOCK_SIZE, log_blocks / 8));
+		set_layout(fs_superblock.super);
+		disk->write(0, fs_superblock.data, Disk::IO_SUPER);
+
+		// Invalida o checkpoint de uma formatação anterior e grava o primeiro, com o imap vazio
+		pooled_block empty_buffer(disk);
+		memset((*empty_buffer).data, 0, BLOCK_SIZE);
+		disk->write(1, (*empty_buffer).data, Disk::IO_SUPER);
+		imap.assign(n_inodes, 0);
+		checkpoint_seq = 0;
+		log_head = log_start();
+		dead.clear();
+		checkpoint_write();
+
+		set_bitmap(disk);
+		return 1;
+	}
+	set_layout(fs_superblock.super);
+
+	// A tabela zerada pelo hospedeiro já está pronta; senão fica para depois
+	bool zeroed = lazy;
+	for (int g = 0; g < ngroups && zeroed; g++)
+	{
+		zeroed = disk->zero_blocks(group_start(g), group_inode_blocks);
+	}
+	fs_superblock.super.inode_blocks_uninit = lazy && !zeroed ? n_inodes : 0;
+	ninodeblocks = n_inodes;
+	inode_ready = n_inodes - fs_superblock.super.inode_blocks_uninit;
 
-	disk->write(0, fs_superblock.data);
+	disk->write(0, fs_superblock.data, Disk::IO_SUPER);
 
 	// formatacao dos blocos de inode
-	for (int i = 1; i < n_inodes + 1; i++)
+	for (int i = 0; i < n_inodes && !lazy; i++)
 	{
-		union fs_block fs_inodeblock;
+		pooled_block fs_inodeblock_buffer(disk);
+		fs_block &fs_inodeblock = *fs_inodeblock_buffer;
 		for (int j = 0; j < INODES_PER_BLOCK; j++)
 		{
 			fs_inodeblock.inode[j].isvalid = 0;
@@ -52,7 +152,7 @@ int INE5412_FS::fs_format()
 			}
 			fs_inodeblock.inode[j].indirect = 0;
 		}
-		disk->write(i, fs_inodeblock.data);
+		disk->write(inode_block(i), fs_inodeblock.data, Disk::IO_INODE);
 	}
 
 	// formatacao do bitmap
@@ -61,7 +161,8 @@ int INE5412_FS::fs_format()
 	return 1;
 }
 
-void INE5412_FS::fs_debug()
+template <class G>
+void INE5412_FS_Impl<G>::fs_debug()
 {
 	// Verifica se o sistema de arquivos está montado
 	if (!is_mounted)
@@ -72,27 +173,52 @@ void INE5412_FS::fs_debug()
 		return;
 	}
 
-	union fs_block block;
+	pooled_block block_buffer(disk);
+	fs_block &block = *block_buffer;
 
-	disk->read(0, block.data);
+	disk->read(0, block.data, Disk::IO_SUPER);
 
 	cout << "superblock:\n";
 	cout << "    " << (block.super.magic == FS_MAGIC ? "magic number is valid\n" : "magic number is invalid!\n");
+	cout << "    " << BLOCK_SIZE << " bytes per block\n";
 	cout << "    " << block.super.nblocks << " blocks\n";
 	cout << "    " << block.super.ninodeblocks << " inode blocks\n";
 	cout << "    " << block.super.ninodes << " inodes\n";
+	if (block.super.group_blocks != 0)
+	{
+		cout << "    " << ngroups << " block groups\n";
+		for (int g = 0; g < ngroups; g++)
+		{
+			cout << "    group " << g << ": blocks " << group_start(g) << "-" << group_end(g) - 1 << ", "
+				 << group_free[g] << " free blocks, " << group_free_inodes[g] << " free inodes\n";
+		}
+	}
+
+	if (block.super.inode_blocks_uninit != 0)
+	{
+		cout << "    " << ninodeblocks - inode_ready << " inode blocks not yet initialized\n";
+	}
+	if (segment_blocks != 0)
+	{
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		int clean = std::count(segment_used.begin(), segment_used.end(), 0);
+		cout << "    log-structured: " << segment_used.size() << " segments of " << segment_blocks << " blocks, "
+			 << clean << " clean, head at block " << log_head << ", checkpoint " << checkpoint_seq << ", "
+			 << dead.size() << " blocks freed at the next checkpoint\n";
+	}
 
 	int n_blocks = block.super.ninodeblocks;
 
 	for (int i = 0; i < n_blocks; i++)
 	{
-		disk->read(i + 1, block.data);
+		inode_table_read(i, block);
 
 		for (int j = 0; j < INODES_PER_BLOCK; j++)
 		{
 			if (block.inode[j].isvalid != 0)
 			{
-				cout << "inode " << i * INODES_PER_BLOCK + j << ":\n";
+				int type = block.inode[j].isvalid;
+				cout << "inode " << i * INODES_PER_BLOCK + j << (type == INODE_SNAPSHOT ? " (snapshot):\n" : type == INODE_DIR ? " (directory):\n" : ":\n");
 				cout << "    size: " << block.inode[j].size << " bytes\n";
 				if (block.inode[j].size > 0)
 				{
@@ -110,8 +236,9 @@ void INE5412_FS::fs_debug()
 				{
 					cout << "    indirect block: " << block.inode[j].indirect << "\n";
 					cout << "    indirect data blocks: ";
-					union fs_block indirect_block;
-					disk->read(block.inode[j].indirect, indirect_block.data);
+					pooled_block indirect_block_buffer(disk);
+					fs_block &indirect_block = *indirect_block_buffer;
+					disk->read(block.inode[j].indirect, indirect_block.data, Disk::IO_INDIRECT);
 					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
 					{
 						if (indirect_block.pointers[k] != 0)
@@ -136,7 +263,8 @@ void INE5412_FS::fs_debug()
 // Se estiver correto, então assume-se que o disco contém um sistema de
 // arquivos correto. Se algum outro número estiver presente, então a montagem falha,
 // talvez porque o disco não esteja formatado ou contém algum outro tipo de dado.
-int INE5412_FS::fs_mount()
+template <class G>
+int INE5412_FS_Impl<G>::fs_mount()
 {
 	// verifica se o disco já está montado
 	if (is_mounted)
@@ -147,31 +275,84 @@ int INE5412_FS::fs_mount()
 	}
 
 	// verifica se ha um sistema de arquivos valido
-	union fs_block fs_superblock;
-	disk->read(0, fs_superblock.data);
+	pooled_block fs_superblock_buffer(disk);
+	fs_block &fs_superblock = *fs_superblock_buffer;
+	disk->read(0, fs_superblock.data, Disk::IO_SUPER);
 	if (fs_superblock.super.magic != FS_MAGIC)
 	{
 		cout << "ERROR: disco não possui um sistema de arquivos valido\n";
 		return 0;
 	}
 
-	// construcao do bitmap
+	// verifica se o sistema de arquivos usa o tamanho de bloco desta instância
+	int block_size = fs_superblock.super.block_size ? fs_superblock.super.block_size : Disk::DISK_BLOCK_SIZE;
+	if (block_size != BLOCK_SIZE)
+	{
+		cout << "ERROR: sistema de arquivos usa blocos de " << block_size << " bytes, não " << BLOCK_SIZE << "\n";
+		return 0;
+	}
+
+	// Os ponteiros de bloco são int: até 2^31 blocos (8 TiB com blocos de 4 KiB)
+	int pointer_bytes = fs_superblock.super.pointer_bytes ? fs_superblock.super.pointer_bytes : (int)sizeof(int);
+	if (pointer_bytes != (int)sizeof(int))
+	{
+		cout << "ERROR: ponteiros de bloco de " << pointer_bytes << " bytes não suportados\n";
+		return 0;
+	}
+
+	// construcao do bitmap e das contagens de referência
 	set_bitmap(disk);
+	refcount.assign(disk->size(), 0);
+	set_layout(fs_superblock.super);
 
-	union fs_block block;
-	disk->read(0, block.data);
+	pooled_block block_buffer(disk);
+	fs_block &block = *block_buffer;
+	disk->read(0, block.data, Disk::IO_SUPER);
 	int n_blocks = block.super.ninodeblocks;
+	ninodes = block.super.ninodes;
+	ninodeblocks = n_blocks;
+	inode_ready = n_blocks - block.super.inode_blocks_uninit;
 
-	for(int i = 0; i < n_blocks; i++)
+	if (segment_blocks != 0)
+	{
+		// Modo de log: o imap vem do checkpoint mais recente; os checkpoints
+		// ficam no início do disco e os blocos da tabela de inodos, no log
+		if (!checkpoint_read())
+		{
+			cout << "ERROR: nenhum checkpoint válido\n";
+			return 0;
+		}
+		for (int b = 1; b < log_start(); b++)
+		{
+			disk->bitmap[b] = 1;
+		}
+		for (int i = 0; i < n_blocks; i++)
+		{
+			if (imap[i] != 0)
+			{
+				disk->bitmap[imap[i]] = 1;
+				refcount[imap[i]] = 1;
+			}
+		}
+	}
+	else
 	{
-        disk->bitmap[i + 1] = 1;
-	} 
+		for(int i = 0; i < n_blocks; i++)
+		{
+	        disk->bitmap[inode_block(i)] = 1;
+		}
+	}
 
+	group_free_inodes.assign(ngroups, 0);
 	for (int i = 0; i < n_blocks; i++)
 	{
-		disk->read(i + 1, block.data);
+		inode_table_read(i, block);
 		for (int j = 0; j < INODES_PER_BLOCK; j++)
 		{
+			if (!block.inode[j].isvalid && i * INODES_PER_BLOCK + j != 0)
+			{
+				group_free_inodes[inode_group(i * INODES_PER_BLOCK + j)]++;
+			}
 			if (block.inode[j].isvalid)
 			{
 				for (int k = 0; k < POINTERS_PER_INODE; k++)
@@ -179,18 +360,23 @@ int INE5412_FS::fs_mount()
 					if (block.inode[j].direct[k] != 0)
 					{
 						disk->bitmap[block.inode[j].direct[k]] = 1;
+						refcount[block.inode[j].direct[k]]++;
 					}
 				}
-				if (block.inode[j].indirect != 0)
+				// Um bloco indireto compartilhado por clones tem seus
+				// ponteiros contados uma única vez
+				if (block.inode[j].indirect != 0 && refcount[block.inode[j].indirect]++ == 0)
 				{
 					disk->bitmap[block.inode[j].indirect] = 1;
-					union fs_block indirect_block;
-					disk->read(block.inode[j].indirect, indirect_block.data);
+					pooled_block indirect_block_buffer(disk);
+					fs_block &indirect_block = *indirect_block_buffer;
+					disk->read(block.inode[j].indirect, indirect_block.data, Disk::IO_INDIRECT);
 					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
 					{
 						if (indirect_block.pointers[k] != 0)
 						{
 							disk->bitmap[indirect_block.pointers[k]] = 1;
+							refcount[indirect_block.pointers[k]]++;
 						}
 					}
 				}
@@ -198,7 +384,41 @@ int INE5412_FS::fs_mount()
 		}
 	}
 
+	nfree = 0;
+	group_free.assign(ngroups, 0);
+	for (int i = 1; i < disk->size(); i++)
+	{
+		if (!disk->bitmap[i])
+		{
+			group_free[group_of(i)]++;
+			nfree++;
+		}
+	}
+	nreserved = 0;
+
+	if (segment_blocks != 0)
+	{
+		int nsegments = (disk->size() - log_start() + segment_blocks - 1) / segment_blocks;
+		segment_used.assign(nsegments, 0);
+		for (int b = log_start(); b < disk->size(); b++)
+		{
+			if (disk->bitmap[b])
+				segment_used[segment_of(b)]++;
+		}
+		segment_live = segment_used;
+		dead.clear();
+	}
+
 	is_mounted = true;
+
+	if (inode_ready < n_blocks)
+	{
+		initializer = std::thread(&INE5412_FS_Impl<G>::initializer_run, this);
+	}
+	if (segment_blocks != 0)
+	{
+		cleaner = std::thread(&INE5412_FS_Impl<G>::cleaner_run, this);
+	}
 	
 	return 1;
 }
@@ -207,7 +427,8 @@ int INE5412_FS::fs_mount()
 // Em caso de sucesso, retorna o inúmero (positivo).
 // Em caso de falha, retorna zero.
 // (Note que isto implica que zero não pode ser um inúmero válido)
-int INE5412_FS::fs_create()
+template <class G>
+int INE5412_FS_Impl<G>::fs_create()
 {
 	// Verifica se o sistema de arquivos está montado
 	if (!is_mounted)
@@ -218,26 +439,73 @@ int INE5412_FS::fs_create()
 		return 0;
 	}
 
-	// Procura por um inodo livre
-	union fs_block block;
-	disk->read(0, block.data);
+	log_reclaim();
+	return inode_create(1);
+}
+
+// Cria um novo inodo vazio marcado como INODE_DIR, para a camada de diretórios.
+// Retorna o inúmero, ou zero em caso de falha.
+template <class G>
+int INE5412_FS_Impl<G>::fs_create_dir()
+{
+	// Verifica se o sistema de arquivos está montado
+	if (!is_mounted)
+	{
+		cout << "ERROR: disco não está montado.\n";
+		return 0;
+	}
+
+	log_reclaim();
+	return inode_create(INODE_DIR);
+}
+
+// Corpo de fs_create, também usado por fs_clone, que já detém a trava de um inodo.
+// "type" é o valor de isvalid do novo inodo.
+template <class G>
+int INE5412_FS_Impl<G>::inode_create(int type)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+
+	// Escolhe o primeiro grupo com inodos livres cuja fração de blocos livres não
+	// é menor que a do disco todo, para que os dados do arquivo caibam perto dele
+	int group = -1;
+	long data_blocks = disk->size() - 1 - (long)ngroups * group_inode_blocks;
+	for (int g = 0; g < ngroups; g++)
+	{
+		long group_data_blocks = group_end(g) - group_start(g) - group_inode_blocks;
+		if (group_free_inodes[g] > 0 && group_free[g] * data_blocks >= nfree * group_data_blocks)
+		{
+			group = g;
+			break;
+		}
+	}
+	for (int g = 0; g < ngroups && group < 0; g++)
+	{
+		if (group_free_inodes[g] > 0)
+			group = g;
+	}
+	if (group < 0)
+	{
+		return 0;
+	}
 
+	// Procura por um inodo livre na fatia da tabela de inodos do grupo
 	int inumber = 0;
-	for (int i = 0; i < block.super.ninodeblocks; i++)
+	for (int i = group * group_inode_blocks; i < (group + 1) * group_inode_blocks; i++)
 	{
 		// Lê o bloco de inodos
-		union fs_block inode_block;
-		disk->read(i + 1, inode_block.data);
+		pooled_block inode_block_buffer(disk);
+		fs_block &inode_block = *inode_block_buffer;
+		inode_table_read(i, inode_block);
 
-		// Procura por um inodo livre
-		for (int j = 1; j < INODES_PER_BLOCK + 1; j++)
+		// Procura por um inodo livre (o inúmero zero não é válido)
+		for (int j = (i == 0 ? 1 : 0); j < INODES_PER_BLOCK; j++)
 		{
 			fs_inode inode = inode_block.inode[j];
 			// Verifica se o inodo está livre
 			if (inode.isvalid == 0)
 			{
-				inumber = i * INODES_PER_BLOCK + j;
-				inode.isvalid = 1;
+				inode.isvalid = type;
 				inode.indirect = 0;
 				inode.size = 0;
 				for (int k = 0; k < POINTERS_PER_INODE; k++)
@@ -245,8 +513,13 @@ int INE5412_FS::fs_create()
 					inode.direct[k] = 0;
 				}
 				inode_block.inode[j] = inode;
-				inode_block.inode[j].isvalid = 1;
-				disk->write(i + 1, inode_block.data);
+				inode_block.inode[j].isvalid = type;
+				if (!inode_table_write(i, inode_block))
+				{
+					return 0;
+				}
+				inumber = i * INODES_PER_BLOCK + j;
+				group_free_inodes[group]--;
 				break;
 			}
 		}
@@ -264,15 +537,13 @@ int INE5412_FS::fs_create()
 // este inodo e os retorna ao mapa de blocos livres.
 // Em caso de sucesso, retorna 1.
 // Em caso de falha, retorna 0.
-int INE5412_FS::fs_delete(int inumber)
+template <class G>
+int INE5412_FS_Impl<G>::fs_delete(int inumber)
 {
-	union fs_block block;
-	disk->read(0, block.data);
-
-	int n_inodes = block.super.ninodes;
+	fs_inode inode;
 
 	// Verifica se o sistema de arquivos está montado
-	if (!is_mounted || inumber <= 0 || inumber >= n_inodes)
+	if (!is_mounted || inumber <= 0 || inumber >= ninodes)
 	{
 		// debug
 		// Sistema de arquivos não montado, retorne erro
@@ -280,15 +551,14 @@ int INE5412_FS::fs_delete(int inumber)
 		return 0;
 	}
 
-	// Cálculo dos índices de bloco e inode
-	int blockNumber = 1 + inumber / INODES_PER_BLOCK;
-	int indexInBlock = inumber % INODES_PER_BLOCK;
+	log_reclaim();
+	std::lock_guard<std::mutex> guard(inode_lock(inumber));
 
-	// Lê o bloco do inodo
-	disk->read(blockNumber, block.data);
+	// Descarta os dados ainda não descarregados
+	dirty_discard(inumber);
 
-	// Obtém o inodo específico do bloco
-	fs_inode inode = block.inode[indexInBlock];
+	// Lê o inodo
+	inode_load(inumber, inode);
 
 	// Verifica se o inodo é válido
 	if (!inode.isvalid)
@@ -299,7 +569,7 @@ int INE5412_FS::fs_delete(int inumber)
 		return 0;
 	}
 
-	inode.isvalid = 0;
+	std::vector<int> freed;
 
 	// Libera os blocos diretos
 	for (int i = 0; i < POINTERS_PER_INODE; i++)
@@ -311,7 +581,7 @@ int INE5412_FS::fs_delete(int inumber)
 		if (blockNumber != 0)
 		{
 			// Libera o bloco
-			disk->bitmap[blockNumber] = 0;
+			freed.push_back(blockNumber);
 		}
 	}
 
@@ -319,32 +589,39 @@ int INE5412_FS::fs_delete(int inumber)
 	if (inode.indirect != 0)
 	{
 		// Lê o bloco indireto
-		union fs_block indirectBlock;
-		disk->read(inode.indirect, indirectBlock.data);
+		pooled_block indirectBlock_buffer(disk);
+		fs_block &indirectBlock = *indirectBlock_buffer;
+		disk->read(inode.indirect, indirectBlock.data, Disk::IO_INDIRECT);
 
-		// Libera os blocos indiretos
-		for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+		// Os blocos indiretos só perdem uma referência quando o bloco
+		// indireto deixa de ser compartilhado com algum clone
+		if (release_block(inode.indirect))
 		{
-			// Obtém o número do bloco
-			int blockNumber = indirectBlock.pointers[i];
-
-			// Verifica se o bloco é válido
-			if (blockNumber != 0)
+			// Libera os blocos indiretos
+			for (int i = 0; i < POINTERS_PER_BLOCK; i++)
 			{
-				// Libera o bloco
-				disk->bitmap[blockNumber] = 0;
+				// Obtém o número do bloco
+				int blockNumber = indirectBlock.pointers[i];
+
+				// Verifica se o bloco é válido
+				if (blockNumber != 0)
+				{
+					// Libera o bloco
+					freed.push_back(blockNumber);
+				}
 			}
 		}
-
-		// Libera o bloco indireto
-		disk->bitmap[inode.indirect] = 0;
 	}
 
-	// Libera o inodo
-	block.inode[indexInBlock].isvalid = 0;
+	release_blocks(freed);
 
-	// Escreve o bloco de volta no disco
-	disk->write(blockNumber, block.data);
+	// Libera o inodo e o escreve de volta no disco
+	inode.isvalid = 0;
+	inode_save(inumber, inode);
+	{
+		std::lock_guard<std::mutex> meta_guard(meta_mutex);
+		group_free_inodes[inode_group(inumber)]++;
+	}
 
 	// Retorna sucesso
 
@@ -354,7 +631,8 @@ int INE5412_FS::fs_delete(int inumber)
 // Retorna o tamanho lógico do inodo especificado, em bytes.
 // Note que zero é um tamanho lógico válido para um inodo!
 // Em caso de falha, retorna -1
-int INE5412_FS::fs_getsize(int inumber)
+template <class G>
+int INE5412_FS_Impl<G>::fs_getsize(int inumber)
 {
 	// Verifica se o sistema de arquivos está montado
 	if (!is_mounted)
@@ -365,29 +643,41 @@ int INE5412_FS::fs_getsize(int inumber)
 		return -1;
 	}
 
-	// Calcula o número do bloco do inodo
-	int blockNumber = 1 + inumber / INODES_PER_BLOCK;
-
-	// Calcula o índice dentro do bloco
-	int indexInBlock = inumber % INODES_PER_BLOCK;
-
-	// Lê o bloco do inodo
-	union fs_block block;
-	disk->read(blockNumber, block.data);
-
-	// Obtém o inodo específico do bloco
-	fs_inode inode = block.inode[indexInBlock];
+	// Lê o inodo
+	fs_inode inode;
+	std::lock_guard<std::mutex> guard(inode_lock(inumber));
 
 	// Verifica se o inodo é válido
-	if (inode.isvalid != 1)
+	if (!inode_load(inumber, inode) || !inode.isvalid)
 	{
 		// Inodo inválido, retorne erro
 		cout << "ERROR: inodo inválido.\n";
 		return -1;
 	}
 
-	// Retorna o tamanho lógico do inodo
-	return inode.size;
+	// Retorna o tamanho lógico do inodo, incluindo dados ainda não descarregados
+	fs_dirty *pending = dirty_find(inumber);
+	return pending ? pending->size : inode.size;
+}
+
+// Retorna o tipo do inodo, isto é, o seu campo isvalid: 1 para um arquivo,
+// INODE_SNAPSHOT ou INODE_DIR. Um inúmero livre ou fora da tabela retorna zero.
+template <class G>
+int INE5412_FS_Impl<G>::fs_gettype(int inumber)
+{
+	// Verifica se o sistema de arquivos está montado
+	if (!is_mounted)
+	{
+		cout << "ERROR: disco não está montado.\n";
+		return 0;
+	}
+
+	fs_inode inode;
+	if (!inode_load(inumber, inode))
+	{
+		return 0;
+	}
+	return inode.isvalid;
 }
 
 // Lê dado de um inodo válido.
@@ -396,7 +686,8 @@ int INE5412_FS::fs_getsize(int inumber)
 // O Número de bytes efetivamente lidos pode ser menos que o número de bytes requisitados,
 // caso o fim do inodo seja alcançado.
 // Se o inúmero dado for inválido, ou algum outro erro for encontrado, retorna 0.
-int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
+template <class G>
+int INE5412_FS_Impl<G>::fs_read(int inumber, char *data, int length, int offset)
 {
 	// Verifica se o sistema de arquivos está montado
 	if (!is_mounted)
@@ -405,24 +696,24 @@ int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
 		return 0;
 	}
 
-	// Calcula o número do bloco do inodo e o índice dentro do bloco
-	int blockNumber = 1 + inumber / INODES_PER_BLOCK;
-	int indexInBlock = inumber % INODES_PER_BLOCK;
-
-	// Lê o bloco do inodo
-	union fs_block block;
-	disk->read(blockNumber, block.data);
-
-	// Obtém o inodo específico do bloco
-	fs_inode inode = block.inode[indexInBlock];
+	// Lê o inodo
+	fs_inode inode;
+	std::lock_guard<std::mutex> guard(inode_lock(inumber));
 
 	// Verifica se o inodo é válido
-	if (!inode.isvalid)
+	if (!inode_load(inumber, inode) || !inode.isvalid)
 	{
 		cout << "ERROR: inodo inválido.\n";
 		return 0;
 	}
 
+	// Dados ainda não descarregados (alocação adiada) têm precedência sobre o disco
+	fs_dirty *pending = dirty_find(inumber);
+	if (pending)
+	{
+		inode.size = pending->size;
+	}
+
 	// Verifica se o offset está dentro do tamanho do arquivo
 	if (offset >= inode.size)
 	{
@@ -435,32 +726,58 @@ int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
 		length = inode.size - offset;
 	}
 
+	// O bloco indireto é lido uma única vez por chamada
+	pooled_block indirect_block_buffer(disk);
+	fs_block &indirect_block = *indirect_block_buffer;
+	if (inode.indirect != 0 && (offset + length - 1) / BLOCK_SIZE >= POINTERS_PER_INODE)
+	{
+		disk->read(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+	else
+	{
+		memset(indirect_block.data, 0, BLOCK_SIZE);
+	}
+
 	int total_read = 0; // Total de bytes lidos
 	while (total_read < length)
 	{
-		int block_rel = offset / Disk::DISK_BLOCK_SIZE;
-		int pos_in_block = offset % Disk::DISK_BLOCK_SIZE;
-		int size_to_read = min(Disk::DISK_BLOCK_SIZE - pos_in_block, length - total_read);
+		int block_rel = offset / BLOCK_SIZE;
+		int pos_in_block = offset % BLOCK_SIZE;
+		int size_to_read = min(BLOCK_SIZE - pos_in_block, length - total_read);
 
-		int physical_block;
-		if (block_rel < POINTERS_PER_INODE)
+		int physical_block = block_map(inode, indirect_block, block_rel);
+		const char *buffered = dirty_block(pending, block_rel);
+
+		if (buffered)
+		{
+			memcpy(data + total_read, buffered + pos_in_block, size_to_read);
+		}
+		else if (physical_block == 0)
+		{
+			// Buraco dentro do tamanho lógico (ex.: após fs_truncate): lê como zeros
+			memset(data + total_read, 0, size_to_read);
+		}
+		else if (pos_in_block == 0 && size_to_read == BLOCK_SIZE)
 		{
-			physical_block = inode.direct[block_rel];
+			// Blocos inteiros fisicamente consecutivos são lidos em uma única
+			// requisição, direto para o buffer do chamador
+			int max_run = (length - total_read) / BLOCK_SIZE;
+			int run = 1;
+			while (run < max_run && block_map(inode, indirect_block, block_rel + run) == physical_block + run && !dirty_block(pending, block_rel + run))
+			{
+				run++;
+			}
+			disk->read_blocks(physical_block, run, data + total_read);
+			size_to_read = run * BLOCK_SIZE;
 		}
 		else
 		{
-			union fs_block indirect_block;
-			disk->read(inode.indirect, indirect_block.data);
-			physical_block = indirect_block.pointers[block_rel - POINTERS_PER_INODE];
+			pooled_block data_block_buffer(disk);
+			fs_block &data_block = *data_block_buffer;
+			disk->read(physical_block, data_block.data);
+			memcpy(data + total_read, data_block.data + pos_in_block, size_to_read);
 		}
 
-		if (physical_block == 0)
-			break; // Não há mais dados para ler
-
-		union fs_block data_block;
-		disk->read(physical_block, data_block.data);
-		memcpy(data + total_read, data_block.data + pos_in_block, size_to_read);
-
 		total_read += size_to_read;
 		offset += size_to_read;
 	}
@@ -475,7 +792,8 @@ int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
 // O número de bytes efetivamente escritos pode ser menor que o número de
 // bytes requisitados, caso o disco se torne cheio.
 // Se o inúmero dado for inválido, ou qualquer outro erro for encontrado, retorna 0.
-int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
+template <class G>
+int INE5412_FS_Impl<G>::fs_write(int inumber, const char *data, int length, int offset)
 {
 	// Verifica se o sistema de arquivos está montado
 	if (!is_mounted)
@@ -484,119 +802,1940 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
 		return 0;
 	}
 
-	// Calcula o número do bloco do inodo e o índice dentro do bloco
-	int blockNumber = 1 + inumber / INODES_PER_BLOCK;
-	int indexInBlock = inumber % INODES_PER_BLOCK;
+	log_reclaim();
 
-	// Lê o bloco do inodo
-	union fs_block block;
-	disk->read(blockNumber, block.data);
-
-	// Obtém o inodo específico do bloco
-	fs_inode &inode = block.inode[indexInBlock];
+	// Lê o inodo
+	fs_inode inode;
+	std::lock_guard<std::mutex> guard(inode_lock(inumber));
 
 	// Verifica se o inodo é válido
-	if (!inode.isvalid)
+	if (!inode_load(inumber, inode) || !inode.isvalid)
 	{
 		cout << "ERROR: inodo inválido.\n";
 		return 0;
 	}
 
+	// Os inodos de um snapshot não podem ser alterados
+	if (inode.isvalid == INODE_SNAPSHOT)
+	{
+		cout << "ERROR: inodo pertence a um snapshot.\n";
+		return 0;
+	}
+
+	// No modo de alocação adiada os dados ficam em memória até o descarregamento
+	if (delalloc)
+	{
+		return write_delayed(inumber, inode, data, length, offset);
+	}
+
+	fs_inode original = inode;
+
+	// O bloco indireto é lido uma única vez e escrito de volta no final, se mudou
+	pooled_block indirect_block_buffer(disk);
+	fs_block &indirect_block = *indirect_block_buffer;
+	bool indirect_dirty = false;
+	if (inode.indirect != 0 && (offset + length - 1) / BLOCK_SIZE >= POINTERS_PER_INODE)
+	{
+		disk->read(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+	else
+	{
+		memset(indirect_block.data, 0, BLOCK_SIZE);
+	}
+
 	int total_written = 0;
 	while (total_written < length)
 	{
-		int block_rel = (offset + total_written) / Disk::DISK_BLOCK_SIZE;
-		int pos_in_block = (offset + total_written) % Disk::DISK_BLOCK_SIZE;
-		int size_to_write = min(Disk::DISK_BLOCK_SIZE - pos_in_block, length - total_written);
+		int block_rel = (offset + total_written) / BLOCK_SIZE;
+		int pos_in_block = (offset + total_written) % BLOCK_SIZE;
+		int size_to_write = min(BLOCK_SIZE - pos_in_block, length - total_written);
 
-		int physical_block;
-		if (block_rel < POINTERS_PER_INODE)
+		// Tamanho máximo de um arquivo atingido
+		if (block_rel >= POINTERS_PER_INODE + POINTERS_PER_BLOCK)
 		{
-			// Bloco direto
-			physical_block = inode.direct[block_rel];
-			if (physical_block == 0)
-			{
-				// Aloca um novo bloco se necessário
-				physical_block = allocate_block();
-				if (physical_block == 0)
-				{
-					break; // Disco cheio
-				}
-				inode.direct[block_rel] = physical_block;
-			}
+			break;
 		}
-		else
+
+		if (block_rel >= POINTERS_PER_INODE)
 		{
 			// Bloco indireto
 			if (inode.indirect == 0)
 			{
-				inode.indirect = allocate_block();
+				// Todos os ponteiros começam em 0 (indirect_block já está zerado)
+				inode.indirect = allocate_block(inumber);
 				if (inode.indirect == 0)
 				{
 					break; // Disco cheio
 				}
-				// Inicializa todos os ponteiros para 0
-				union fs_block indirect_block;
-				for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+				indirect_dirty = true;
+			}
+			else if (!indirect_dirty)
+			{
+				// Um bloco indireto compartilhado com um clone é copiado antes de mudar
+				int old_indirect = inode.indirect;
+				if (!indirect_private(inumber, inode, indirect_block))
 				{
-					indirect_block.pointers[i] = 0;
+					break; // Disco cheio
 				}
-				disk->write(inode.indirect, indirect_block.data);
+				indirect_dirty = indirect_dirty || inode.indirect != old_indirect;
 			}
+		}
 
-			union fs_block indirect_block;
-			disk->read(inode.indirect, indirect_block.data);
-			physical_block = indirect_block.pointers[block_rel - POINTERS_PER_INODE];
+		int physical_block = block_map(inode, indirect_block, block_rel);
+		int source_block = physical_block;
+		bool fresh_block = false;
+		if (physical_block == 0 || !overwrite_in_place(physical_block))
+		{
+			// Aloca um novo bloco se necessário, ou copia um bloco compartilhado
+			// com um clone antes da primeira escrita (no modo de log, sempre)
+			physical_block = allocate_block(inumber);
 			if (physical_block == 0)
 			{
-				physical_block = allocate_block();
-				if (physical_block == 0)
-				{
-					break; // Disco cheio
-				}
+				break; // Disco cheio
+			}
+			if (block_rel < POINTERS_PER_INODE)
+			{
+				inode.direct[block_rel] = physical_block;
+			}
+			else
+			{
 				indirect_block.pointers[block_rel - POINTERS_PER_INODE] = physical_block;
-				disk->write(inode.indirect, indirect_block.data);
+				indirect_dirty = true;
 			}
+			fresh_block = source_block == 0;
 		}
 
-		union fs_block data_block;
-		disk->read(physical_block, data_block.data);
+		// Um bloco recém alocado pode conter restos de um arquivo apagado:
+		// começa zerado em vez de ser lido do disco. Um bloco inteiramente
+		// sobrescrito não precisa ser lido.
+		pooled_block data_block_buffer(disk);
+		fs_block &data_block = *data_block_buffer;
+		if (size_to_write < BLOCK_SIZE)
+		{
+			if (fresh_block)
+				memset(data_block.data, 0, BLOCK_SIZE);
+			else
+				disk->read(source_block, data_block.data);
+		}
 		memcpy(data_block.data + pos_in_block, data + total_written, size_to_write);
 		disk->write(physical_block, data_block.data);
 
+		// Solta a referência ao bloco compartilhado depois de copiá-lo
+		if (source_block != physical_block && source_block != 0)
+		{
+			release_blocks(std::vector<int>(1, source_block));
+		}
+
 		total_written += size_to_write;
 	}
 
-	// Atualiza o tamanho do inodo se necessário
-	if (inode.size < offset + total_written)
+	if (indirect_dirty)
+	{
+		disk->write(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+
+	// Atualiza o inodo se o tamanho ou os ponteiros mudaram
+	if (total_written > 0 && inode.size < offset + total_written)
 	{
 		inode.size = offset + total_written;
-		disk->write(blockNumber, block.data);
+	}
+	if (memcmp(&inode, &original, sizeof(fs_inode)) != 0)
+	{
+		inode_save(inumber, inode);
 	}
 
 	return total_written;
 }
 
-int INE5412_FS::allocate_block()
+// Trunca o inodo para "newsize" bytes.
+// Se o novo tamanho for menor, libera os blocos de dados além do fim e o bloco
+// indireto quando ele deixa de ser necessário; o final do último bloco é zerado.
+// Se for maior, o arquivo cresce com um buraco que é lido como zeros.
+// Em caso de sucesso, retorna 1.
+// Em caso de falha, retorna 0.
+template <class G>
+int INE5412_FS_Impl<G>::fs_truncate(int inumber, int newsize)
 {
-	for (std::size_t i = 0; i < disk->bitmap.size(); i++)
+	// Verifica se o sistema de arquivos está montado
+	if (!is_mounted)
 	{
-		if (disk->bitmap[i] == 0)
-		{
-			disk->bitmap[i] = 1;
-			return i;
-		}
+		cout << "ERROR: disco não está montado.\n";
+		return 0;
 	}
-	return 0; // Não há blocos livres
-}
 
-void INE5412_FS::set_bitmap(Disk *disk)
-{
-	disk->bitmap.resize(disk->size());
-	// indice 0 usado pelo superbloco
-	disk->bitmap[0] = 1;
-	for (std::size_t i = 1; i < disk->bitmap.size(); i++)
+	log_reclaim();
+	fs_inode inode;
+	std::lock_guard<std::mutex> guard(inode_lock(inumber));
+	flush_inode(inumber);
+	if (!inode_load(inumber, inode) || !inode.isvalid)
 	{
-		disk->bitmap[i] = 0;
+		cout << "ERROR: inodo inválido.\n";
+		return 0;
 	}
-}
+
+	// Os inodos de um snapshot não podem ser alterados
+	if (inode.isvalid == INODE_SNAPSHOT)
+	{
+		cout << "ERROR: inodo pertence a um snapshot.\n";
+		return 0;
+	}
+
+	const int max_size = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * BLOCK_SIZE;
+	if (newsize < 0 || newsize > max_size)
+	{
+		cout << "ERROR: tamanho inválido.\n";
+		return 0;
+	}
+
+	if (newsize < inode.size)
+	{
+		// Número de blocos que continuam pertencendo ao arquivo
+		int keep = (newsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int first = max(keep - (int)POINTERS_PER_INODE, 0);
+		std::vector<int> freed;
+
+		pooled_block indirect_block_buffer(disk);
+		fs_block &indirect_block = *indirect_block_buffer;
+		if (inode.indirect != 0)
+		{
+			disk->read(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+		}
+		else
+		{
+			memset(indirect_block.data, 0, BLOCK_SIZE);
+		}
+
+		// O final do último bloco é zerado para que um crescimento futuro leia zeros.
+		// Um bloco compartilhado com um clone é copiado em vez de alterado; a cópia
+		// é alocada antes de qualquer mudança para que a falha não deixe nada pela metade.
+		int tail = newsize % BLOCK_SIZE;
+		int tail_block = tail != 0 ? block_map(inode, indirect_block, keep - 1) : 0;
+		int target = tail_block;
+		bool tail_shared = tail_block != 0 && (!overwrite_in_place(tail_block) || (keep - 1 >= POINTERS_PER_INODE && !overwrite_in_place(inode.indirect)));
+		bool indirect_shared = inode.indirect != 0 && first > 0 && !overwrite_in_place(inode.indirect);
+
+		// As cópias não podem usar o espaço prometido a dados com alocação adiada
+		int needed = (tail_shared ? 1 : 0) + (indirect_shared ? 1 : 0);
+		if (!reserve_blocks(needed))
+		{
+			cout << "ERROR: espaço insuficiente.\n";
+			return 0;
+		}
+		unreserve_blocks(needed);
+
+		if (tail_shared)
+		{
+			target = allocate_block(inumber);
+			if (target == 0)
+			{
+				cout << "ERROR: espaço insuficiente.\n";
+				return 0;
+			}
+		}
+
+		// O bloco indireto vai mudar: se for compartilhado com um clone, copia antes
+		if (inode.indirect != 0 && first > 0 && !indirect_private(inumber, inode, indirect_block))
+		{
+			if (target != tail_block)
+				release_block(target);
+			cout << "ERROR: espaço insuficiente.\n";
+			return 0;
+		}
+
+		if (tail_block != 0)
+		{
+			pooled_block data_block_buffer(disk);
+			fs_block &data_block = *data_block_buffer;
+			disk->read(tail_block, data_block.data);
+			memset(data_block.data + tail, 0, BLOCK_SIZE - tail);
+			disk->write(target, data_block.data);
+
+			if (target != tail_block)
+			{
+				if (keep - 1 < POINTERS_PER_INODE)
+					inode.direct[keep - 1] = target;
+				else
+					indirect_block.pointers[keep - 1 - POINTERS_PER_INODE] = target;
+				freed.push_back(tail_block);
+			}
+		}
+
+		// Libera os blocos diretos além do fim
+		for (int k = keep; k < POINTERS_PER_INODE; k++)
+		{
+			if (inode.direct[k] != 0)
+			{
+				freed.push_back(inode.direct[k]);
+				inode.direct[k] = 0;
+			}
+		}
+
+		// Libera os blocos apontados pelo bloco indireto
+		if (inode.indirect != 0)
+		{
+			if (first == 0)
+			{
+				// O bloco indireto não é mais necessário; os blocos que ele aponta
+				// só são liberados se nenhum clone ainda o compartilhar
+				if (release_block(inode.indirect))
+				{
+					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+					{
+						if (indirect_block.pointers[k] != 0)
+							freed.push_back(indirect_block.pointers[k]);
+					}
+				}
+				inode.indirect = 0;
+			}
+			else
+			{
+				for (int k = first; k < POINTERS_PER_BLOCK; k++)
+				{
+					if (indirect_block.pointers[k] != 0)
+					{
+						freed.push_back(indirect_block.pointers[k]);
+						indirect_block.pointers[k] = 0;
+					}
+				}
+				disk->write(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+			}
+		}
+
+		release_blocks(freed);
+	}
+
+	inode.size = newsize;
+	inode_save(inumber, inode);
+
+	return 1;
+}
+
+// Reserva os blocos de dados que cobrem [offset, offset + length) no inodo.
+// Os blocos que ainda não existem são alocados de uma vez, em sequências
+// contíguas, e zerados no disco. O tamanho lógico do inodo não é alterado,
+// de modo que um fs_write posterior apenas preenche os blocos já reservados.
+// A reserva é tudo ou nada: se não houver espaço suficiente nada é alocado.
+// Em caso de sucesso, retorna 1.
+// Em caso de falha, retorna 0.
+template <class G>
+int INE5412_FS_Impl<G>::fs_fallocate(int inumber, int offset, int length)
+{
+	// Verifica se o sistema de arquivos está montado
+	if (!is_mounted)
+	{
+		cout << "ERROR: disco não está montado.\n";
+		return 0;
+	}
+
+	log_reclaim();
+	fs_inode inode;
+	std::lock_guard<std::mutex> guard(inode_lock(inumber));
+	flush_inode(inumber);
+	if (!inode_load(inumber, inode) || !inode.isvalid)
+	{
+		cout << "ERROR: inodo inválido.\n";
+		return 0;
+	}
+
+	// Os inodos de um snapshot não podem ser alterados
+	if (inode.isvalid == INODE_SNAPSHOT)
+	{
+		cout << "ERROR: inodo pertence a um snapshot.\n";
+		return 0;
+	}
+
+	const int max_blocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+	if (offset < 0 || length <= 0 || (long)offset + length > (long)max_blocks * BLOCK_SIZE)
+	{
+		cout << "ERROR: intervalo inválido.\n";
+		return 0;
+	}
+
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + length - 1) / BLOCK_SIZE;
+
+	pooled_block indirect_block_buffer(disk);
+	fs_block &indirect_block = *indirect_block_buffer;
+	if (inode.indirect != 0)
+	{
+		disk->read(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+	else
+	{
+		memset(indirect_block.data, 0, BLOCK_SIZE);
+	}
+
+	// Levanta os blocos lógicos que ainda não possuem bloco físico
+	std::vector<int> missing;
+	for (int k = first; k <= last; k++)
+	{
+		int physical_block = k < POINTERS_PER_INODE ? inode.direct[k] : indirect_block.pointers[k - POINTERS_PER_INODE];
+		if (physical_block == 0)
+		{
+			missing.push_back(k);
+		}
+	}
+	bool need_indirect = inode.indirect == 0 && last >= POINTERS_PER_INODE;
+	int needed = missing.size() + (need_indirect ? 1 : 0);
+
+	if (needed == 0)
+	{
+		return 1;
+	}
+
+	// Não pode usar o espaço já prometido a dados com alocação adiada,
+	// contando a cópia do bloco indireto que indirect_private venha a fazer
+	int copies = !need_indirect && inode.indirect != 0 && last >= POINTERS_PER_INODE && !overwrite_in_place(inode.indirect) ? 1 : 0;
+	if (!reserve_blocks(needed + copies))
+	{
+		cout << "ERROR: espaço insuficiente.\n";
+		return 0;
+	}
+	unreserve_blocks(needed + copies);
+
+	// Reserva os blocos no mapa de livres em sequências contíguas
+	std::vector<int> reserved;
+	std::vector<std::pair<int, int>> runs;
+	while ((int)reserved.size() < needed)
+	{
+		int start;
+		int count = allocate_run(inumber, needed - reserved.size(), start);
+		if (count == 0)
+		{
+			// Disco cheio: desfaz a reserva
+			release_blocks(reserved);
+			cout << "ERROR: espaço insuficiente.\n";
+			return 0;
+		}
+		runs.push_back(std::make_pair(start, count));
+		for (int b = start; b < start + count; b++)
+		{
+			reserved.push_back(b);
+		}
+	}
+
+	// Zera os blocos reservados, uma requisição por sequência. Sem suporte a
+	// zero_blocks no hospedeiro, grava zeros de INIT_CHUNK em INIT_CHUNK blocos
+	int chunk = INIT_CHUNK;
+	Disk::run_buffer zeros_buffer;
+	for (std::size_t r = 0; r < runs.size(); r++)
+	{
+		if (disk->zero_blocks(runs[r].first, runs[r].second))
+		{
+			continue;
+		}
+		std::size_t bytes = (std::size_t)std::min(runs[r].second, chunk) * BLOCK_SIZE;
+		char *zeros = zeros_buffer.get(bytes);
+		memset(zeros, 0, bytes);
+		for (int b = runs[r].first; b < runs[r].first + runs[r].second; b += chunk)
+		{
+			disk->write_blocks(b, std::min(chunk, runs[r].first + runs[r].second - b), zeros);
+		}
+	}
+
+	// Os ponteiros do bloco indireto vão mudar: se for compartilhado com um clone, copia antes
+	if (!need_indirect && inode.indirect != 0 && last >= POINTERS_PER_INODE && !indirect_private(inumber, inode, indirect_block))
+	{
+		release_blocks(reserved);
+		cout << "ERROR: espaço insuficiente.\n";
+		return 0;
+	}
+
+	// Distribui os blocos reservados entre os ponteiros do inodo
+	std::size_t next = 0;
+	if (need_indirect)
+	{
+		inode.indirect = reserved[next++];
+	}
+	for (std::size_t i = 0; i < missing.size(); i++)
+	{
+		int k = missing[i];
+		if (k < POINTERS_PER_INODE)
+			inode.direct[k] = reserved[next++];
+		else
+			indirect_block.pointers[k - POINTERS_PER_INODE] = reserved[next++];
+	}
+
+	if (last >= POINTERS_PER_INODE)
+	{
+		disk->write(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+	inode_save(inumber, inode);
+
+	return 1;
+}
+
+// Retorna o bloco físico que guarda o bloco lógico "block_rel" do inodo,
+// ou zero se ele não estiver alocado. "indirect_block" deve conter o bloco
+// indireto do inodo (ou zeros, se ele não existir).
+template <class G>
+int INE5412_FS_Impl<G>::block_map(const fs_inode &inode, const fs_block &indirect_block, int block_rel)
+{
+	if (block_rel < POINTERS_PER_INODE)
+		return inode.direct[block_rel];
+	if (block_rel < POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+		return indirect_block.pointers[block_rel - POINTERS_PER_INODE];
+	return 0;
+}
+
+// Cria um novo inodo que compartilha os blocos de dados (e o bloco indireto)
+// do inodo "src_inumber", sem copiá-los. Os blocos só são copiados quando um
+// dos dois inodos é escrito por fs_write.
+// Em caso de sucesso, retorna o inúmero do clone.
+// Em caso de falha, retorna zero.
+template <class G>
+int INE5412_FS_Impl<G>::fs_clone(int src_inumber)
+{
+	// Verifica se o sistema de arquivos está montado
+	if (!is_mounted)
+	{
+		cout << "ERROR: disco não está montado.\n";
+		return 0;
+	}
+
+	// Um clone de um diretório seria um segundo diretório com as mesmas
+	// entradas, que a camada de diretórios não contaria
+	if (fs_gettype(src_inumber) == INODE_DIR)
+	{
+		cout << "ERROR: inodo " << src_inumber << " é um diretório.\n";
+		return 0;
+	}
+
+	log_reclaim();
+	return inode_clone(src_inumber);
+}
+
+// Corpo de fs_clone, também usado por fs_snapshot, que clona os diretórios.
+// O clone é sempre um arquivo comum.
+template <class G>
+int INE5412_FS_Impl<G>::inode_clone(int src_inumber)
+{
+	fs_inode inode;
+	std::lock_guard<std::mutex> guard(inode_lock(src_inumber));
+	flush_inode(src_inumber);
+	if (!inode_load(src_inumber, inode) || !inode.isvalid)
+	{
+		cout << "ERROR: inodo inválido.\n";
+		return 0;
+	}
+
+	int inumber = inode_create(1);
+	if (inumber == 0)
+	{
+		return 0;
+	}
+
+	// Os blocos apontados pelo bloco indireto continuam com uma única
+	// referência: a do próprio bloco indireto, que passa a ser compartilhado
+	std::vector<int> shared;
+	for (int k = 0; k < POINTERS_PER_INODE; k++)
+	{
+		if (inode.direct[k] != 0)
+			shared.push_back(inode.direct[k]);
+	}
+	if (inode.indirect != 0)
+	{
+		shared.push_back(inode.indirect);
+	}
+	block_ref(shared);
+
+	inode.isvalid = 1;
+	inode_save(inumber, inode);
+
+	return inumber;
+}
+
+// Cria um snapshot da imagem: clona cada inodo válido e grava os pares
+// (inúmero original, inúmero do clone) em um novo inodo, o manifesto.
+// Os clones e o manifesto são marcados como INODE_SNAPSHOT: não podem ser
+// escritos nem entram em snapshots posteriores, mas podem ser lidos,
+// clonados (para restaurar um arquivo) e apagados. Os diretórios também são
+// clonados, mas os clones deles não são INODE_DIR: a camada de diretórios os
+// enxerga como arquivos.
+// Em caso de sucesso, retorna o inúmero do manifesto.
+// Em caso de falha, retorna zero.
+template <class G>
+int INE5412_FS_Impl<G>::fs_snapshot()
+{
+	// Verifica se o sistema de arquivos está montado
+	if (!is_mounted)
+	{
+		cout << "ERROR: disco não está montado.\n";
+		return 0;
+	}
+
+	// O snapshot enxerga apenas o que já está no disco
+	fs_sync();
+
+	// Levanta os inodos válidos antes de criar qualquer clone
+	std::vector<int> sources;
+	for (int i = 0; i < ninodes / INODES_PER_BLOCK; i++)
+	{
+		pooled_block block_buffer(disk);
+		fs_block &block = *block_buffer;
+		{
+			std::lock_guard<std::mutex> guard(meta_mutex);
+			inode_table_read(i, block);
+		}
+		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		{
+			if (block.inode[j].isvalid == 1 || block.inode[j].isvalid == INODE_DIR)
+				sources.push_back(i * INODES_PER_BLOCK + j);
+		}
+	}
+
+	std::vector<int> manifest;
+	for (std::size_t i = 0; i < sources.size(); i++)
+	{
+		log_reclaim();
+		int clone = inode_clone(sources[i]);
+		if (clone == 0)
+		{
+			break;
+		}
+		manifest.push_back(sources[i]);
+		manifest.push_back(clone);
+	}
+
+	int inumber = 0;
+	int bytes = manifest.size() * sizeof(int);
+	if (manifest.size() == 2 * sources.size())
+	{
+		inumber = fs_create();
+	}
+	if (inumber != 0 && fs_write(inumber, (const char *)manifest.data(), bytes, 0) != bytes)
+	{
+		fs_delete(inumber);
+		inumber = 0;
+	}
+
+	if (inumber == 0)
+	{
+		// Desfaz os clones já criados
+		cout << "ERROR: não foi possível criar o snapshot.\n";
+		for (std::size_t i = 1; i < manifest.size(); i += 2)
+		{
+			fs_delete(manifest[i]);
+		}
+		return 0;
+	}
+
+	// Congela os clones e o manifesto
+	std::vector<int> frozen(1, inumber);
+	for (std::size_t i = 1; i < manifest.size(); i += 2)
+	{
+		frozen.push_back(manifest[i]);
+	}
+	for (std::size_t i = 0; i < frozen.size(); i++)
+	{
+		log_reclaim();
+		std::lock_guard<std::mutex> guard(inode_lock(frozen[i]));
+		flush_inode(frozen[i]);
+		fs_inode inode;
+		inode_load(frozen[i], inode);
+		inode.isvalid = INODE_SNAPSHOT;
+		inode_save(frozen[i], inode);
+	}
+
+	return inumber;
+}
+
+// Lê o inodo indicado pelo inúmero.
+// Retorna 1 se o inúmero estiver dentro da tabela de inodos, 0 caso contrário.
+template <class G>
+int INE5412_FS_Impl<G>::inode_load(int inumber, fs_inode &inode)
+{
+	if (inumber <= 0 || inumber >= ninodes)
+	{
+		return 0;
+	}
+
+	pooled_block block_buffer(disk);
+	fs_block &block = *block_buffer;
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	inode_table_read(inumber / INODES_PER_BLOCK, block);
+	inode = block.inode[inumber % INODES_PER_BLOCK];
+	return 1;
+}
+
+// Escreve o inodo indicado pelo inúmero de volta no seu bloco.
+// Retorna 0 se o bloco da tabela não puder ser gravado.
+template <class G>
+int INE5412_FS_Impl<G>::inode_save(int inumber, const fs_inode &inode)
+{
+	pooled_block block_buffer(disk);
+	fs_block &block = *block_buffer;
+	int index = inumber / INODES_PER_BLOCK;
+	// Outros inodos do mesmo bloco podem estar sendo atualizados em paralelo
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	inode_table_read(index, block);
+	block.inode[inumber % INODES_PER_BLOCK] = inode;
+	if (!inode_table_write(index, block))
+	{
+		cout << "ERROR: não foi possível gravar o inodo " << inumber << ".\n";
+		return 0;
+	}
+	return 1;
+}
+
+// Lê o bloco "index" da tabela de inodos. Um bloco ainda não inicializado pela
+// formatação rápida, ou nunca escrito no modo de log, é lido como zeros.
+// O chamador detém meta_mutex (ou o sistema de arquivos ainda não está em uso).
+template <class G>
+void INE5412_FS_Impl<G>::inode_table_read(int index, fs_block &block)
+{
+	int location = index < inode_ready ? inode_block(index) : 0;
+	if (location == 0)
+	{
+		memset(block.data, 0, BLOCK_SIZE);
+		return;
+	}
+	disk->read(location, block.data, Disk::IO_INODE);
+}
+
+// Grava o bloco "index" da tabela de inodos: no lugar, zerando antes a tabela
+// até ele se a formatação rápida ainda não o fez, ou numa posição nova do log.
+// O chamador detém meta_mutex. Retorna 0 se não houver espaço.
+template <class G>
+int INE5412_FS_Impl<G>::inode_table_write(int index, const fs_block &block)
+{
+	if (segment_blocks == 0)
+	{
+		if (index >= inode_ready && !inode_table_init(index + 1))
+		{
+			return 0;
+		}
+		disk->write(inode_block(index), block.data, Disk::IO_INODE);
+		return 1;
+	}
+
+	// Um bloco da tabela gravado pela primeira vez ocupa espaço de vez, como os
+	// dados, e não pode usar o espaço reservado
+	if (imap[index] == 0 && nfree - log_reserve() - nreserved < 1)
+	{
+		return 0;
+	}
+	int location = log_next(imap[index] != 0);
+	if (location == 0)
+	{
+		return 0;
+	}
+	disk->write(location, block.data, Disk::IO_INODE);
+	if (imap[index] != 0)
+	{
+		refcount[imap[index]] = 0;
+		block_free(imap[index]);
+		table_rewrites++;
+	}
+	imap[index] = location;
+	return 1;
+}
+
+// Trava que serializa as operações sobre um mesmo inodo.
+template <class G>
+std::mutex &INE5412_FS_Impl<G>::inode_lock(int inumber)
+{
+	return inode_mutexes[(unsigned int)inumber % INODE_LOCKS];
+}
+
+template <class G>
+INE5412_FS_Impl<G>::~INE5412_FS_Impl()
+{
+	initializer_stop = true;
+	if (initializer.joinable())
+	{
+		initializer.join();
+	}
+	{
+		std::lock_guard<std::mutex> guard(cleaner_mutex);
+		cleaner_stop = true;
+	}
+	cleaner_wakeup.notify_one();
+	if (cleaner.joinable())
+	{
+		cleaner.join();
+	}
+}
+
+// Zera os blocos da tabela de inodos de inode_ready até pelo menos upto, em
+// trechos contíguos no disco, e registra o novo limite no superbloco.
+// Avança de INIT_CHUNK em INIT_CHUNK blocos (1 MiB) para não reescrever o superbloco
+// a cada inodo criado. O chamador detém meta_mutex. Retorna 0 em caso de falha.
+template <class G>
+int INE5412_FS_Impl<G>::inode_table_init(int upto)
+{
+	int chunk = INIT_CHUNK;
+	upto = std::min(ninodeblocks, std::max(upto, inode_ready + chunk));
+	if (upto <= inode_ready)
+	{
+		return 1;
+	}
+
+	char *zeros;
+	if (posix_memalign((void **)&zeros, Disk::BUFFER_ALIGN, (std::size_t)chunk * BLOCK_SIZE) != 0)
+	{
+		return 0;
+	}
+	memset(zeros, 0, (std::size_t)chunk * BLOCK_SIZE);
+
+	for (int i = inode_ready; i < upto;)
+	{
+		// Não passa do fim da fatia do grupo, que é onde os blocos deixam de ser contíguos
+		int count = std::min(std::min(upto - i, chunk), group_inode_blocks - i % group_inode_blocks);
+		disk->write_blocks(inode_block(i), count, zeros, Disk::IO_INODE);
+		i += count;
+	}
+	free(zeros);
+
+	pooled_block super_buffer(disk);
+	fs_block &super = *super_buffer;
+	disk->read(0, super.data, Disk::IO_SUPER);
+	super.super.inode_blocks_uninit = ninodeblocks - upto;
+	disk->write(0, super.data, Disk::IO_SUPER);
+	inode_ready = upto;
+	return 1;
+}
+
+// Thread de inicialização: zera o restante da tabela de inodos em segundo
+// plano, um trecho por vez, liberando meta_mutex entre os trechos.
+template <class G>
+void INE5412_FS_Impl<G>::initializer_run()
+{
+	while (!initializer_stop)
+	{
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		if (inode_ready >= ninodeblocks || !inode_table_init(inode_ready + 1))
+		{
+			break;
+		}
+	}
+}
+
+// Lê do superbloco a divisão do disco em grupos.
+template <class G>
+void INE5412_FS_Impl<G>::set_layout(const fs_superblock &super)
+{
+	if (super.group_blocks == 0)
+	{
+		// Formato original: um único grupo com toda a tabela de inodos no início
+		ngroups = 1;
+		group_blocks = super.nblocks - 1;
+		group_inode_blocks = super.ninodeblocks;
+	}
+	else
+	{
+		group_blocks = super.group_blocks;
+		ngroups = (super.nblocks - 1) / group_blocks;
+		group_inode_blocks = super.ninodeblocks / ngroups;
+	}
+	segment_blocks = super.segment_blocks;
+	imap_blocks = segment_blocks ? (super.ninodeblocks + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK : 0;
+}
+
+// Primeiro bloco do grupo, onde começa a sua fatia da tabela de inodos.
+template <class G>
+int INE5412_FS_Impl<G>::group_start(int group)
+{
+	return 1 + group * group_blocks;
+}
+
+// Bloco seguinte ao último do grupo.
+template <class G>
+int INE5412_FS_Impl<G>::group_end(int group)
+{
+	return group == ngroups - 1 ? disk->size() : group_start(group + 1);
+}
+
+// Grupo ao qual o bloco pertence.
+template <class G>
+int INE5412_FS_Impl<G>::group_of(int block)
+{
+	return std::min((block - 1) / group_blocks, ngroups - 1);
+}
+
+// Bloco de disco que guarda o bloco "index" da tabela de inodos.
+template <class G>
+int INE5412_FS_Impl<G>::inode_block(int index)
+{
+	if (segment_blocks != 0)
+		return imap[index];
+	return group_start(index / group_inode_blocks) + index % group_inode_blocks;
+}
+
+// Grupo cuja fatia da tabela de inodos contém o inodo.
+template <class G>
+int INE5412_FS_Impl<G>::inode_group(int inumber)
+{
+	return inumber / INODES_PER_BLOCK / group_inode_blocks;
+}
+
+// Aloca um bloco, procurando primeiro no grupo do inodo e depois nos
+// grupos seguintes, voltando ao início do disco se preciso.
+template <class G>
+int INE5412_FS_Impl<G>::allocate_block(int inumber)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	if (segment_blocks != 0)
+	{
+		return log_next();
+	}
+	int size = disk->bitmap.size();
+	int goal = group_start(inode_group(inumber));
+	for (int n = 0; n < size - 1; n++)
+	{
+		int i = 1 + (goal - 1 + n) % (size - 1);
+		if (disk->bitmap[i] == 0)
+		{
+			block_take(i);
+			return i;
+		}
+	}
+	return 0; // Não há blocos livres
+}
+
+// Marca um bloco livre como usado, com uma referência. O chamador detém meta_mutex.
+template <class G>
+void INE5412_FS_Impl<G>::block_take(int block)
+{
+	disk->bitmap[block] = 1;
+	refcount[block] = 1;
+	nfree--;
+	group_free[group_of(block)]--;
+	if (segment_blocks != 0)
+	{
+		segment_used[segment_of(block)]++;
+		segment_live[segment_of(block)]++;
+	}
+}
+
+// Devolve ao mapa de livres um bloco sem referências. No modo de log ele só
+// é reaproveitado depois do próximo checkpoint. O chamador detém meta_mutex.
+template <class G>
+void INE5412_FS_Impl<G>::block_free(int block)
+{
+	if (segment_blocks != 0)
+	{
+		segment_live[segment_of(block)]--;
+		dead.push_back(block);
+		return;
+	}
+	disk->bitmap[block] = 0;
+	nfree++;
+	group_free[group_of(block)]++;
+}
+
+// Um bloco só pode ser sobrescrito no lugar se não for compartilhado com um
+// clone e o sistema de arquivos não estiver no modo de log.
+template <class G>
+bool INE5412_FS_Impl<G>::overwrite_in_place(int block)
+{
+	return segment_blocks == 0 && block_refs(block) <= 1;
+}
+
+template <class G>
+void INE5412_FS_Impl<G>::set_bitmap(Disk *disk)
+{
+	disk->bitmap.resize(disk->size());
+	// indice 0 usado pelo superbloco
+	disk->bitmap[0] = 1;
+	for (std::size_t i = 1; i < disk->bitmap.size(); i++)
+	{
+		disk->bitmap[i] = 0;
+	}
+}
+
+// Procura uma sequência contígua de até "wanted" blocos livres e a marca
+// como usada de uma só vez. Prefere a primeira sequência com o tamanho pedido,
+// começando a busca pelo grupo do inodo; se não houver, usa a maior disponível.
+// Retorna o número de blocos reservados (zero se o disco estiver cheio)
+// e o primeiro bloco da sequência em "start".
+template <class G>
+int INE5412_FS_Impl<G>::allocate_run(int inumber, int wanted, int &start)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	if (segment_blocks != 0)
+	{
+		// Continua a partir da cabeça do log, sem passar do fim do segmento
+		start = log_next();
+		int count = start != 0 ? 1 : 0;
+		while (count > 0 && count < wanted && log_head < disk->size() && !disk->bitmap[log_head] &&
+			   segment_of(log_head) == segment_of(start) && log_head == start + count)
+		{
+			block_take(log_head++);
+			count++;
+		}
+		return count;
+	}
+	int best_start = 0, best_len = 0;
+	int goal = group_start(inode_group(inumber));
+	// Duas passadas: do grupo do inodo até o fim do disco, e do início até ele
+	for (int pass = 0; pass < 2 && best_len < wanted; pass++)
+	{
+		std::size_t i = pass == 0 ? goal : 1;
+		std::size_t end = pass == 0 ? disk->bitmap.size() : goal;
+		while (i < end)
+		{
+			if (disk->bitmap[i] != 0)
+			{
+				i++;
+				continue;
+			}
+
+			std::size_t run_start = i;
+			while (i < end && disk->bitmap[i] == 0 && (int)(i - run_start) < wanted)
+			{
+				i++;
+			}
+			int run_len = i - run_start;
+			if (run_len > best_len)
+			{
+				best_start = run_start;
+				best_len = run_len;
+			}
+			if (best_len == wanted)
+			{
+				break;
+			}
+		}
+	}
+
+	if (best_len == 0)
+	{
+		return 0; // Não há blocos livres
+	}
+
+	std::fill(disk->bitmap.begin() + best_start, disk->bitmap.begin() + best_start + best_len, true);
+	std::fill(refcount.begin() + best_start, refcount.begin() + best_start + best_len, 1);
+	nfree -= best_len;
+	for (int b = best_start; b < best_start + best_len; b++)
+	{
+		group_free[group_of(b)]--;
+	}
+	start = best_start;
+	return best_len;
+}
+
+// Solta uma referência de cada bloco; os que ficam sem referências
+// voltam ao mapa de blocos livres.
+template <class G>
+void INE5412_FS_Impl<G>::release_blocks(const std::vector<int> &blocks)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	for (std::size_t i = 0; i < blocks.size(); i++)
+	{
+		if (--refcount[blocks[i]] <= 0)
+		{
+			refcount[blocks[i]] = 0;
+			block_free(blocks[i]);
+		}
+	}
+}
+
+// Solta uma referência do bloco. Retorna 1 se ele voltou ao mapa de blocos livres.
+template <class G>
+int INE5412_FS_Impl<G>::release_block(int block)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	if (--refcount[block] > 0)
+	{
+		return 0;
+	}
+	refcount[block] = 0;
+	block_free(block);
+	return 1;
+}
+
+// Acrescenta uma referência a cada bloco (compartilhamento por um clone).
+template <class G>
+void INE5412_FS_Impl<G>::block_ref(const std::vector<int> &blocks)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	for (std::size_t i = 0; i < blocks.size(); i++)
+	{
+		refcount[blocks[i]]++;
+	}
+}
+
+// Retorna o número de inodos (ou blocos indiretos) que apontam para o bloco.
+template <class G>
+int INE5412_FS_Impl<G>::block_refs(int block)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	return refcount[block];
+}
+
+// Garante que o bloco indireto do inodo pode ser sobrescrito no lugar.
+// Se não puder (compartilhado com um clone, ou modo de log), o inodo passa a
+// apontar para uma cópia recém alocada, que o chamador deve escrever com o
+// conteúdo de "indirect_block"; se era compartilhado, cada bloco apontado
+// ganha uma referência a mais. Retorna 0 se o disco estiver cheio.
+template <class G>
+int INE5412_FS_Impl<G>::indirect_private(int inumber, fs_inode &inode, const fs_block &indirect_block)
+{
+	if (overwrite_in_place(inode.indirect))
+	{
+		return 1;
+	}
+
+	int copy = allocate_block(inumber);
+	if (copy == 0)
+	{
+		return 0;
+	}
+
+	if (block_refs(inode.indirect) > 1)
+	{
+		std::vector<int> pointers;
+		for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+		{
+			if (indirect_block.pointers[k] != 0)
+				pointers.push_back(indirect_block.pointers[k]);
+		}
+		block_ref(pointers);
+	}
+	release_block(inode.indirect);
+	inode.indirect = copy;
+	return 1;
+}
+
+// Liga ou desliga a alocação adiada.
+// Com ela ligada, fs_write apenas guarda os dados em buffers por inodo; os blocos
+// só são alocados no descarregamento (fs_sync, excesso de blocos sujos em memória,
+// ou operações que precisam do inodo no disco, como fs_truncate e fs_clone).
+// Como o tamanho final já é conhecido nesse momento, o arquivo recebe uma única
+// sequência contígua e é escrito sequencialmente. Desligá-la descarrega tudo.
+template <class G>
+void INE5412_FS_Impl<G>::fs_set_delalloc(bool enabled)
+{
+	if (!enabled)
+	{
+		fs_sync();
+	}
+	delalloc = enabled;
+}
+
+// Descarrega os dados de todos os inodos com alocação adiada.
+// Deve ser chamada antes de fechar o disco.
+// Retorna 1 se todos os dados foram escritos, 0 caso contrário.
+template <class G>
+int INE5412_FS_Impl<G>::fs_sync()
+{
+	std::vector<int> inumbers;
+	{
+		std::lock_guard<std::mutex> guard(dirty_mutex);
+		for (typename std::map<int, fs_dirty>::iterator it = dirty.begin(); it != dirty.end(); ++it)
+		{
+			inumbers.push_back(it->first);
+		}
+	}
+
+	int ok = 1;
+	for (std::size_t i = 0; i < inumbers.size(); i++)
+	{
+		log_reclaim();
+		std::lock_guard<std::mutex> guard(inode_lock(inumbers[i]));
+		ok = flush_inode(inumbers[i]) && ok;
+	}
+
+	// No modo de log, o imap só persiste com um checkpoint
+	if (segment_blocks != 0 && is_mounted)
+	{
+		lock_inodes();
+		{
+			std::lock_guard<std::mutex> guard(meta_mutex);
+			ok = checkpoint_write() && ok;
+		}
+		unlock_inodes();
+	}
+	disk->flush();
+	return ok;
+}
+
+// fs_write no modo de alocação adiada. O chamador detém a trava do inodo.
+// Cada bloco que ainda vai precisar de um bloco físico novo (não alocado,
+// compartilhado com um clone ou no modo de log) tem o espaço reservado agora, para que o
+// descarregamento nunca encontre o disco cheio.
+template <class G>
+int INE5412_FS_Impl<G>::write_delayed(int inumber, const fs_inode &inode, const char *data, int length, int offset)
+{
+	fs_dirty *pending = dirty_find(inumber);
+	if (!pending)
+	{
+		std::lock_guard<std::mutex> guard(dirty_mutex);
+		pending = &dirty[inumber];
+		pending->size = inode.size;
+	}
+
+	pooled_block indirect_block_buffer(disk);
+	fs_block &indirect_block = *indirect_block_buffer;
+	if (inode.indirect != 0 && (offset + length - 1) / BLOCK_SIZE >= POINTERS_PER_INODE)
+	{
+		disk->read(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+	else
+	{
+		memset(indirect_block.data, 0, BLOCK_SIZE);
+	}
+	bool indirect_shared = inode.indirect != 0 && !overwrite_in_place(inode.indirect);
+
+	int total_written = 0;
+	while (total_written < length)
+	{
+		int block_rel = (offset + total_written) / BLOCK_SIZE;
+		int pos_in_block = (offset + total_written) % BLOCK_SIZE;
+		int size_to_write = min(BLOCK_SIZE - pos_in_block, length - total_written);
+
+		// Tamanho máximo de um arquivo atingido
+		if (block_rel >= POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+		{
+			break;
+		}
+
+		std::map<int, std::vector<char>>::iterator it = pending->blocks.find(block_rel);
+		if (it == pending->blocks.end())
+		{
+			int physical_block = block_map(inode, indirect_block, block_rel);
+			bool indirect_needed = block_rel >= POINTERS_PER_INODE && (inode.indirect == 0 || indirect_shared) && !pending->indirect_reserved;
+			int needed = indirect_needed ? 1 : 0;
+			if (physical_block == 0 || !overwrite_in_place(physical_block) || (block_rel >= POINTERS_PER_INODE && indirect_shared))
+			{
+				needed++;
+			}
+			if (!reserve_blocks(needed))
+			{
+				break; // Disco cheio
+			}
+			pending->reserved += needed;
+			pending->indirect_reserved = pending->indirect_reserved || indirect_needed;
+
+			it = pending->blocks.insert(std::make_pair(block_rel, std::vector<char>(BLOCK_SIZE, 0))).first;
+			if (physical_block != 0 && size_to_write < BLOCK_SIZE)
+			{
+				disk->read(physical_block, it->second.data());
+			}
+			ndirty++;
+		}
+
+		// Escritas repetidas no mesmo bloco se acumulam no buffer
+		memcpy(it->second.data() + pos_in_block, data + total_written, size_to_write);
+		total_written += size_to_write;
+	}
+
+	if (total_written > 0 && pending->size < offset + total_written)
+	{
+		pending->size = offset + total_written;
+	}
+
+	// Memória demais presa em buffers: descarrega este inodo
+	if (ndirty > DELALLOC_MAX_DIRTY)
+	{
+		flush_inode(inumber);
+	}
+
+	return total_written;
+}
+
+// Descarrega os buffers de um inodo. O chamador detém a trava do inodo.
+// Os blocos que precisam de uma posição nova recebem sequências contíguas em
+// ordem lógica, e blocos lógicos consecutivos que caem em blocos físicos
+// consecutivos são escritos em uma única requisição.
+// Retorna 1 em caso de sucesso, 0 se algum dado não pôde ser escrito.
+template <class G>
+int INE5412_FS_Impl<G>::flush_inode(int inumber)
+{
+	fs_dirty *pending = dirty_find(inumber);
+	if (!pending || pending->blocks.empty())
+	{
+		dirty_discard(inumber);
+		return 1;
+	}
+
+	// A partir daqui as alocações usam o espaço reservado por write_delayed
+	unreserve_blocks(pending->reserved);
+	pending->reserved = 0;
+
+	fs_inode inode;
+	if (!inode_load(inumber, inode) || !inode.isvalid)
+	{
+		dirty_discard(inumber);
+		return 0;
+	}
+	fs_inode original = inode;
+
+	pooled_block indirect_block_buffer(disk);
+	fs_block &indirect_block = *indirect_block_buffer;
+	bool indirect_dirty = false;
+	if (inode.indirect != 0)
+	{
+		disk->read(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+	else
+	{
+		memset(indirect_block.data, 0, BLOCK_SIZE);
+	}
+
+	// Os blocos indiretos só podem ser escritos se o inodo tiver um bloco
+	// indireto próprio (não compartilhado com um clone)
+	int ok = 1;
+	bool indirect_usable = true;
+	if (pending->blocks.rbegin()->first >= POINTERS_PER_INODE)
+	{
+		if (inode.indirect == 0)
+		{
+			inode.indirect = allocate_block(inumber);
+			indirect_dirty = inode.indirect != 0;
+		}
+		else if (indirect_private(inumber, inode, indirect_block))
+		{
+			indirect_dirty = inode.indirect != original.indirect;
+		}
+		else
+		{
+			indirect_usable = false;
+		}
+		indirect_usable = indirect_usable && inode.indirect != 0;
+	}
+
+	// Blocos que precisam de uma posição nova: não alocados ou compartilhados
+	std::vector<int> rels;
+	std::vector<int> sources;
+	std::vector<int> targets;
+	std::vector<int> relocate;
+	for (std::map<int, std::vector<char>>::iterator it = pending->blocks.begin(); it != pending->blocks.end(); ++it)
+	{
+		int physical_block = block_map(inode, indirect_block, it->first);
+		if (it->first >= POINTERS_PER_INODE && !indirect_usable)
+		{
+			ok = 0;
+			break;
+		}
+		rels.push_back(it->first);
+		sources.push_back(physical_block);
+		targets.push_back(physical_block);
+		if (physical_block == 0 || !overwrite_in_place(physical_block))
+		{
+			relocate.push_back(rels.size() - 1);
+		}
+	}
+
+	// Aloca todas as posições novas de uma vez, em sequências contíguas
+	std::size_t next = 0;
+	while (next < relocate.size())
+	{
+		int start;
+		int count = allocate_run(inumber, relocate.size() - next, start);
+		if (count == 0)
+		{
+			ok = 0; // Disco cheio
+			break;
+		}
+		for (int b = start; b < start + count; b++)
+		{
+			int i = relocate[next++];
+			targets[i] = b;
+			if (rels[i] < POINTERS_PER_INODE)
+			{
+				inode.direct[rels[i]] = b;
+			}
+			else
+			{
+				indirect_block.pointers[rels[i] - POINTERS_PER_INODE] = b;
+				indirect_dirty = true;
+			}
+		}
+	}
+
+	// Os blocos que ficaram sem posição nova não podem ser escritos
+	std::vector<bool> writable(rels.size(), true);
+	for (std::size_t k = next; k < relocate.size(); k++)
+	{
+		writable[relocate[k]] = false;
+	}
+
+	// Escreve os blocos em ordem lógica, agrupando os fisicamente consecutivos
+	std::vector<int> released;
+	// A sequência é montada num buffer alinhado, que o Direct_Disk usa sem cópia
+	Disk::run_buffer run_buffer;
+	std::size_t i = 0;
+	while (i < rels.size())
+	{
+		if (!writable[i])
+		{
+			i++;
+			continue;
+		}
+
+		std::size_t j = i;
+		while (j < rels.size() && writable[j] && targets[j] == targets[i] + (int)(j - i) && rels[j] == rels[i] + (int)(j - i))
+		{
+			if (sources[j] != 0 && sources[j] != targets[j])
+			{
+				released.push_back(sources[j]);
+			}
+			j++;
+		}
+		char *run_data = run_buffer.get((j - i) * BLOCK_SIZE);
+		for (std::size_t k = i; k < j; k++)
+		{
+			memcpy(run_data + (k - i) * BLOCK_SIZE, pending->blocks[rels[k]].data(), BLOCK_SIZE);
+		}
+		disk->write_blocks(targets[i], j - i, run_data);
+		i = j;
+	}
+
+	if (indirect_dirty)
+	{
+		disk->write(inode.indirect, indirect_block.data, Disk::IO_INDIRECT);
+	}
+
+	// Solta as referências aos blocos compartilhados que foram copiados
+	release_blocks(released);
+
+	if (inode.size < pending->size)
+	{
+		inode.size = pending->size;
+	}
+	if (memcmp(&inode, &original, sizeof(fs_inode)) != 0)
+	{
+		inode_save(inumber, inode);
+	}
+
+	dirty_discard(inumber);
+
+	if (!ok)
+	{
+		cout << "ERROR: espaço insuficiente para descarregar o inodo " << inumber << ".\n";
+	}
+	return ok;
+}
+
+// Retorna os buffers com alocação adiada do inodo, ou zero se não houver.
+template <class G>
+typename INE5412_FS_Impl<G>::fs_dirty *INE5412_FS_Impl<G>::dirty_find(int inumber)
+{
+	std::lock_guard<std::mutex> guard(dirty_mutex);
+	typename std::map<int, fs_dirty>::iterator it = dirty.find(inumber);
+	return it == dirty.end() ? 0 : &it->second;
+}
+
+// Retorna o buffer do bloco lógico "block_rel", ou zero se ele não estiver em memória.
+template <class G>
+const char *INE5412_FS_Impl<G>::dirty_block(fs_dirty *pending, int block_rel)
+{
+	if (!pending)
+	{
+		return 0;
+	}
+	std::map<int, std::vector<char>>::iterator it = pending->blocks.find(block_rel);
+	return it == pending->blocks.end() ? 0 : it->second.data();
+}
+
+// Descarta os buffers do inodo sem escrevê-los, devolvendo o espaço reservado.
+template <class G>
+void INE5412_FS_Impl<G>::dirty_discard(int inumber)
+{
+	std::lock_guard<std::mutex> guard(dirty_mutex);
+	typename std::map<int, fs_dirty>::iterator it = dirty.find(inumber);
+	if (it == dirty.end())
+	{
+		return;
+	}
+	ndirty -= it->second.blocks.size();
+	{
+		std::lock_guard<std::mutex> meta_guard(meta_mutex);
+		nreserved -= it->second.reserved;
+	}
+	dirty.erase(it);
+}
+
+// Reserva "count" blocos livres para um descarregamento futuro.
+// Retorna 0 se não houver blocos livres suficientes.
+template <class G>
+int INE5412_FS_Impl<G>::reserve_blocks(int count)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	// No modo de log os últimos blocos livres ficam para a tabela de inodos
+	int available = segment_blocks != 0 ? nfree - log_reserve() : nfree;
+	if (available - nreserved < count)
+	{
+		return 0;
+	}
+	nreserved += count;
+	return 1;
+}
+
+template <class G>
+void INE5412_FS_Impl<G>::unreserve_blocks(int count)
+{
+	std::lock_guard<std::mutex> guard(meta_mutex);
+	nreserved -= count;
+}
+
+// Primeiro bloco do log, logo depois dos dois checkpoints.
+template <class G>
+int INE5412_FS_Impl<G>::log_start()
+{
+	return 1 + 2 * (1 + imap_blocks);
+}
+
+template <class G>
+int INE5412_FS_Impl<G>::segment_start(int segment)
+{
+	return log_start() + segment * segment_blocks;
+}
+
+// Segmento do bloco; o último segmento pode ser menor que os demais.
+template <class G>
+int INE5412_FS_Impl<G>::segment_of(int block)
+{
+	return std::min((block - log_start()) / segment_blocks, (int)segment_used.size() - 1);
+}
+
+// Próximo bloco do log, marcado como usado. Segue a partir da cabeça dentro do
+// segmento corrente; ao fim dele, passa para o próximo segmento limpo. Sem
+// segmentos limpos, ocupa os buracos dos outros segmentos.
+// Os últimos log_reserve() blocos livres só servem à tabela de inodos ("metadata").
+// O chamador detém meta_mutex. Retorna zero se o disco estiver cheio.
+template <class G>
+int INE5412_FS_Impl<G>::log_next(bool metadata)
+{
+	// Os blocos mortos só voltam num checkpoint, que não pode acontecer no meio
+	// de uma operação: o disco está cheio até log_reclaim ou o limpador agirem
+	if (nfree == 0 || (!metadata && nfree <= log_reserve()))
+	{
+		cleaner_wakeup.notify_one();
+		return 0;
+	}
+
+	int nsegments = segment_used.size();
+	for (int n = 0; n <= nsegments; n++)
+	{
+		int segment = segment_of(std::min(log_head, disk->size() - 1));
+		int end = std::min(segment_start(segment + 1), disk->size());
+		while (log_head < end && disk->bitmap[log_head])
+		{
+			log_head++;
+		}
+		if (log_head < end)
+		{
+			block_take(log_head);
+			return log_head++;
+		}
+
+		int next = -1;
+		int clean = 0;
+		for (int k = 1; k <= nsegments; k++)
+		{
+			if (segment_used[(segment + k) % nsegments] == 0)
+			{
+				if (next < 0)
+					next = (segment + k) % nsegments;
+				clean++;
+			}
+		}
+		// Acorda o limpador quando os segmentos limpos começam a faltar
+		if (clean <= std::max(2, nsegments / 10))
+		{
+			cleaner_wakeup.notify_one();
+		}
+		if (next < 0)
+		{
+			break;
+		}
+		log_head = segment_start(next);
+	}
+
+	for (int n = 0; n < disk->size() - log_start(); n++)
+	{
+		int b = log_start() + (log_head - log_start() + n) % (disk->size() - log_start());
+		if (!disk->bitmap[b])
+		{
+			block_take(b);
+			log_head = b + 1;
+			return b;
+		}
+	}
+	return 0;
+}
+
+// Grava o imap e o cabeçalho (por último) na posição do checkpoint seguinte.
+// Como nenhum dos checkpoints gravados a partir daqui aponta para os blocos
+// mortos, eles voltam ao mapa de livres. O chamador detém meta_mutex e as
+// travas de todos os inodos, para que nenhuma operação esteja pela metade.
+template <class G>
+int INE5412_FS_Impl<G>::checkpoint_write()
+{
+	checkpoint_seq++;
+	int slot = 1 + (checkpoint_seq % 2) * (1 + imap_blocks);
+
+	Disk::run_buffer table_buffer;
+	int *table = (int *)table_buffer.get((std::size_t)imap_blocks * BLOCK_SIZE);
+	memset(table, 0, (std::size_t)imap_blocks * BLOCK_SIZE);
+	std::copy(imap.begin(), imap.end(), table);
+	disk->write_blocks(slot + 1, imap_blocks, (const char *)table, Disk::IO_SUPER);
+	// A fila do elevador reordena as escritas: o log e o imap precisam estar no
+	// disco antes do cabeçalho que os valida
+	disk->flush();
+
+	pooled_block header_buffer(disk);
+	fs_block &header = *header_buffer;
+	memset(header.data, 0, BLOCK_SIZE);
+	header.checkpoint.magic = CHECKPOINT_MAGIC;
+	header.checkpoint.sequence = checkpoint_seq;
+	header.checkpoint.log_head = log_head;
+	disk->write(slot, header.data, Disk::IO_SUPER);
+	// e o cabeçalho, antes que os blocos mortos sejam reaproveitados
+	disk->flush();
+
+	for (std::size_t i = 0; i < dead.size(); i++)
+	{
+		disk->bitmap[dead[i]] = 0;
+		nfree++;
+		group_free[group_of(dead[i])]++;
+		segment_used[segment_of(dead[i])]--;
+	}
+	dead.clear();
+	table_rewrites = 0;
+	return 1;
+}
+
+// Carrega o imap do checkpoint válido mais recente. Retorna 0 se não houver nenhum.
+template <class G>
+int INE5412_FS_Impl<G>::checkpoint_read()
+{
+	pooled_block header_buffer(disk);
+	fs_block &header = *header_buffer;
+	int best = -1;
+	for (int k = 0; k < 2; k++)
+	{
+		disk->read(1 + k * (1 + imap_blocks), header.data, Disk::IO_SUPER);
+		if (header.checkpoint.magic == CHECKPOINT_MAGIC && (best < 0 || header.checkpoint.sequence > checkpoint_seq))
+		{
+			best = k;
+			checkpoint_seq = header.checkpoint.sequence;
+			log_head = header.checkpoint.log_head;
+		}
+	}
+	if (best < 0)
+	{
+		return 0;
+	}
+
+	Disk::run_buffer table_buffer;
+	int *table = (int *)table_buffer.get((std::size_t)imap_blocks * BLOCK_SIZE);
+	disk->read_blocks(1 + best * (1 + imap_blocks) + 1, imap_blocks, (char *)table, Disk::IO_SUPER);
+	imap.assign(table, table + ninodeblocks);
+	for (int i = 0; i < ninodeblocks; i++)
+	{
+		if (imap[i] != 0 && (imap[i] < log_start() || imap[i] >= disk->size()))
+		{
+			return 0;
+		}
+	}
+	if (log_head < log_start() || log_head > disk->size())
+	{
+		log_head = log_start();
+	}
+	return 1;
+}
+
+// Travam e soltam todas as travas de inodos, em ordem.
+template <class G>
+void INE5412_FS_Impl<G>::lock_inodes()
+{
+	for (int k = 0; k < INODE_LOCKS; k++)
+	{
+		inode_mutexes[k].lock();
+	}
+}
+
+template <class G>
+void INE5412_FS_Impl<G>::unlock_inodes()
+{
+	for (int k = INODE_LOCKS - 1; k >= 0; k--)
+	{
+		inode_mutexes[k].unlock();
+	}
+}
+
+// Blocos de LOG_RESERVE ainda não gastos: cada bloco da tabela de inodos
+// regravado gasta um até o checkpoint seguinte devolver a cópia antiga.
+// O chamador detém meta_mutex.
+template <class G>
+int INE5412_FS_Impl<G>::log_reserve()
+{
+	return std::max(0, LOG_RESERVE - table_rewrites);
+}
+
+// Ponto seguro para um checkpoint: chamado no início das operações que alocam
+// blocos, antes de travar o inodo. Se o log estiver a menos de um segmento de
+// encher, ou metade de LOG_RESERVE já tiver sido gasta, e houver blocos mortos,
+// grava um checkpoint com todas as travas de inodos, como o limpador, para
+// devolvê-los ao mapa de livres.
+template <class G>
+void INE5412_FS_Impl<G>::log_reclaim()
+{
+	if (segment_blocks == 0)
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		if (dead.empty() || (nfree - nreserved - log_reserve() >= segment_blocks && table_rewrites < LOG_RESERVE / 2))
+		{
+			return;
+		}
+	}
+	lock_inodes();
+	{
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		if (!dead.empty())
+		{
+			checkpoint_write();
+		}
+	}
+	unlock_inodes();
+}
+
+// Thread do limpador: uma passada a cada CLEANER_INTERVAL_MS, ou antes,
+// quando log_next percebe que os segmentos limpos estão acabando.
+template <class G>
+void INE5412_FS_Impl<G>::cleaner_run()
+{
+	int interval = CLEANER_INTERVAL_MS;
+	std::unique_lock<std::mutex> lock(cleaner_mutex);
+	while (!cleaner_stop)
+	{
+		cleaner_wakeup.wait_for(lock, std::chrono::milliseconds(interval));
+		if (cleaner_stop)
+		{
+			break;
+		}
+		lock.unlock();
+		log_clean();
+		lock.lock();
+	}
+}
+
+// Uma passada do limpador. Com todas as travas de inodos, grava um checkpoint
+// para liberar os blocos mortos e, enquanto faltarem segmentos limpos, limpa o
+// segmento com menos blocos vivos (se no máximo CLEAN_LIVE_PERCENT deles estiverem vivos).
+template <class G>
+void INE5412_FS_Impl<G>::log_clean()
+{
+	lock_inodes();
+	{
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		if (!dead.empty())
+		{
+			checkpoint_write();
+		}
+	}
+
+	std::vector<bool> tried;
+	while (true)
+	{
+		int victim = -1;
+		{
+			std::lock_guard<std::mutex> guard(meta_mutex);
+			int nsegments = segment_used.size();
+			tried.resize(nsegments, false);
+			if (std::count(segment_used.begin(), segment_used.end(), 0) > std::max(2, nsegments / 10))
+			{
+				break;
+			}
+			for (int s = 0; s < nsegments; s++)
+			{
+				// Os blocos vivos precisam caber no espaço livre, junto com os blocos da
+				// tabela regravados (no máximo um por bloco vivo)
+				if (tried[s] || s == segment_of(std::min(log_head, disk->size() - 1)) || segment_used[s] == 0 ||
+					segment_live[s] * 100 > segment_blocks * CLEAN_LIVE_PERCENT || 2 * segment_live[s] >= nfree - nreserved - log_reserve())
+					continue;
+				if (victim < 0 || segment_live[s] < segment_live[victim])
+					victim = s;
+			}
+		}
+		if (victim < 0)
+		{
+			break;
+		}
+		tried[victim] = true;
+		segment_clean(victim);
+
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		checkpoint_write();
+	}
+	unlock_inodes();
+}
+
+// Copia para o fim do log os blocos vivos do segmento: os dados e blocos
+// indiretos de cada inodo que tem blocos nele, e os blocos da tabela de inodos.
+// Blocos compartilhados com clones ficam onde estão. O chamador detém as
+// travas de todos os inodos. Retorna o número de blocos copiados.
+template <class G>
+int INE5412_FS_Impl<G>::segment_clean(int segment)
+{
+	int first = segment_start(segment);
+	int end = std::min(segment_start(segment + 1), disk->size());
+	pooled_block table_buffer(disk);
+	fs_block &table = *table_buffer;
+	pooled_block indirect_buffer(disk);
+	fs_block &indirect = *indirect_buffer;
+	pooled_block data_buffer(disk);
+	fs_block &data = *data_buffer;
+
+	// Inodos com algum bloco no segmento
+	std::vector<int> owners;
+	for (int i = 0; i < ninodeblocks; i++)
+	{
+		{
+			std::lock_guard<std::mutex> guard(meta_mutex);
+			if (imap[i] == 0)
+				continue;
+			inode_table_read(i, table);
+		}
+		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		{
+			fs_inode &inode = table.inode[j];
+			if (!inode.isvalid)
+				continue;
+			bool inside = inode.indirect >= first && inode.indirect < end;
+			for (int k = 0; k < POINTERS_PER_INODE; k++)
+			{
+				inside = inside || (inode.direct[k] >= first && inode.direct[k] < end);
+			}
+			if (!inside && inode.indirect != 0)
+			{
+				disk->read(inode.indirect, indirect.data, Disk::IO_INDIRECT);
+				for (int k = 0; k < POINTERS_PER_BLOCK && !inside; k++)
+				{
+					inside = indirect.pointers[k] >= first && indirect.pointers[k] < end;
+				}
+			}
+			if (inside)
+				owners.push_back(i * INODES_PER_BLOCK + j);
+		}
+	}
+
+	int moved = 0;
+	for (std::size_t o = 0; o < owners.size(); o++)
+	{
+		int inumber = owners[o];
+		fs_inode inode;
+		inode_load(inumber, inode);
+		fs_inode original = inode;
+		// Blocos antigos e as cópias feitas deles (e do bloco indireto)
+		std::vector<int> sources;
+		std::vector<int> targets;
+
+		// Copia cada bloco do segmento com uma única referência para o fim do log
+		auto move = [&](int &pointer) -> bool {
+			if (pointer < first || pointer >= end || block_refs(pointer) != 1)
+				return false;
+			int target = allocate_block(inumber);
+			if (target == 0)
+				return false;
+			disk->read(pointer, data.data);
+			disk->write(target, data.data);
+			sources.push_back(pointer);
+			targets.push_back(target);
+			pointer = target;
+			return true;
+		};
+
+		for (int k = 0; k < POINTERS_PER_INODE; k++)
+		{
+			move(inode.direct[k]);
+		}
+		bool undo = false;
+		if (inode.indirect != 0 && block_refs(inode.indirect) == 1)
+		{
+			disk->read(inode.indirect, indirect.data, Disk::IO_INDIRECT);
+			bool indirect_dirty = false;
+			for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+			{
+				indirect_dirty = move(indirect.pointers[k]) || indirect_dirty;
+			}
+			// O bloco indireto muda de lugar se estava no segmento ou se mudou
+			int target = indirect_dirty || (inode.indirect >= first && inode.indirect < end) ? allocate_block(inumber) : 0;
+			if (target != 0)
+			{
+				disk->write(target, indirect.data, Disk::IO_INDIRECT);
+				sources.push_back(inode.indirect);
+				targets.push_back(target);
+				inode.indirect = target;
+			}
+			else if (indirect_dirty)
+			{
+				// Sem espaço para o bloco indireto: o inodo continua com os blocos antigos
+				undo = true;
+			}
+		}
+
+		// Os blocos antigos só são soltos depois que o inodo aponta para as cópias
+		if (!undo && memcmp(&inode, &original, sizeof(fs_inode)) != 0 && !inode_save(inumber, inode))
+		{
+			undo = true;
+		}
+		if (undo)
+		{
+			release_blocks(targets);
+			continue;
+		}
+		release_blocks(sources);
+		moved += targets.size();
+	}
+
+	// Os blocos da tabela de inodos que continuam no segmento
+	for (int i = 0; i < ninodeblocks; i++)
+	{
+		std::lock_guard<std::mutex> guard(meta_mutex);
+		if (imap[i] >= first && imap[i] < end)
+		{
+			inode_table_read(i, table);
+			if (inode_table_write(i, table))
+				moved++;
+		}
+	}
+	return moved;
+}
+
+INE5412_FS *INE5412_FS::create(Disk *d)
+{
+	switch (d->block_size())
+	{
+	case 4096:
+		return new INE5412_FS_Impl<fs_geometry<4096>>(d);
+	case 16384:
+		return new INE5412_FS_Impl<fs_geometry<16384>>(d);
+	case 65536:
+		return new INE5412_FS_Impl<fs_geometry<65536>>(d);
+	}
+	cout << "ERROR: tamanho de bloco " << d->block_size() << " não suportado\n";
+	return 0;
+}
+
+int INE5412_FS::probe_block_size(const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	if (!file)
+	{
+		return 0;
+	}
+
+	// Os campos do superbloco ficam no início do bloco zero, qualquer que seja o tamanho de bloco
+	INE5412_FS_Impl<fs_geometry<Disk::DISK_BLOCK_SIZE>>::fs_superblock super;
+	memset(&super, 0, sizeof(super));
+	size_t got = fread(&super, 1, sizeof(super), file);
+	fclose(file);
+
+	if (got < sizeof(super) || super.magic != FS_MAGIC)
+	{
+		return 0;
+	}
+	return super.block_size ? super.block_size : Disk::DISK_BLOCK_SIZE;
+}
+
+template class INE5412_FS_Impl<fs_geometry<4096>>;
+template class INE5412_FS_Impl<fs_geometry<16384>>;
+template class INE5412_FS_Impl<fs_geometry<65536>>;
@@ -2,14 +2,97 @@
 #define FS_H
 
 #include "disk.h"
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
 
+// Interface do sistema de arquivos, independente do tamanho de bloco.
+// Cada tamanho de bloco suportado tem sua própria instância de
+// INE5412_FS_Impl; create() escolhe a que corresponde ao disco.
 class INE5412_FS
 {
 public:
     static const unsigned int FS_MAGIC = 0xf0f03410;
-    static const unsigned short int INODES_PER_BLOCK = 128;
-    static const unsigned short int POINTERS_PER_INODE = 5;
-    static const unsigned short int POINTERS_PER_BLOCK = 1024;
+    // Valor de isvalid para os inodos congelados por fs_snapshot
+    static const int INODE_SNAPSHOT = 2;
+    // Valor de isvalid para os diretórios criados por fs_create_dir
+    static const int INODE_DIR = 3;
+
+    virtual ~INE5412_FS() {}
+
+    // Cria o sistema de arquivos para o tamanho de bloco do disco.
+    // Retorna zero se o tamanho não for suportado.
+    static INE5412_FS *create(Disk *d);
+    // Lê o tamanho de bloco registrado no superbloco da imagem.
+    // Retorna zero se a imagem não contiver um sistema de arquivos.
+    static int probe_block_size(const char *filename);
+
+    virtual void fs_debug() = 0;
+    virtual int fs_format() = 0;
+    virtual int fs_format_groups(int group_blocks) = 0;
+    // Formatação rápida: a tabela de inodos é zerada depois, aos poucos
+    virtual int fs_format_lazy(int group_blocks) = 0;
+    // Formata no modo de log: toda escrita vai para o fim de um log sequencial
+    virtual int fs_format_log() = 0;
+    virtual int fs_mount() = 0;
+
+    virtual int fs_create() = 0;
+    virtual int fs_create_dir() = 0;
+    virtual int fs_delete(int inumber) = 0;
+    virtual int fs_getsize(int inumber) = 0;
+    // Retorna o isvalid do inodo: 0 se estiver livre, ou INODE_DIR etc.
+    virtual int fs_gettype(int inumber) = 0;
+
+    virtual int fs_read(int inumber, char *data, int length, int offset) = 0;
+    virtual int fs_write(int inumber, const char *data, int length, int offset) = 0;
+
+    virtual int fs_truncate(int inumber, int newsize) = 0;
+    virtual int fs_fallocate(int inumber, int offset, int length) = 0;
+
+    virtual int fs_clone(int src_inumber) = 0;
+    virtual int fs_snapshot() = 0;
+
+    virtual void fs_set_delalloc(bool enabled) = 0;
+    virtual int fs_sync() = 0;
+};
+
+// Geometria derivada do tamanho de bloco. Todas as constantes são conhecidas
+// em tempo de compilação, de modo que os laços sobre inodos e ponteiros de
+// um bloco têm limites fixos em cada instância.
+template <int B>
+class fs_geometry
+{
+public:
+    static const int BLOCK_SIZE = B;
+    static const int POINTERS_PER_INODE = 5;
+    // Um inodo ocupa 32 bytes: isvalid, size, 5 diretos e o indireto
+    static const int INODES_PER_BLOCK = B / 32;
+    static const int POINTERS_PER_BLOCK = B / sizeof(int);
+};
+
+template <class G>
+class INE5412_FS_Impl : public INE5412_FS
+{
+public:
+    static const int BLOCK_SIZE = G::BLOCK_SIZE;
+    static const int INODES_PER_BLOCK = G::INODES_PER_BLOCK;
+    static const int POINTERS_PER_INODE = G::POINTERS_PER_INODE;
+    static const int POINTERS_PER_BLOCK = G::POINTERS_PER_BLOCK;
+    static const unsigned short int INODE_LOCKS = 64;
+    // Máximo de blocos mantidos em memória pela alocação adiada
+    static const int DELALLOC_MAX_DIRTY = 2048;
+    // Número mágico dos cabeçalhos de checkpoint do modo de log
+    static const unsigned int CHECKPOINT_MAGIC = 0xc4ec4b01;
+    // Tamanho dos segmentos do modo de log
+    static const int SEGMENT_BYTES = 1024 * 1024;
+    // Intervalo entre as passadas do limpador de segmentos
+    static const int CLEANER_INTERVAL_MS = 1000;
+    // Um segmento só é limpo se no máximo esta fração dos seus blocos estiver viva
+    static const int CLEAN_LIVE_PERCENT = 50;
+    // Blocos livres do log guardados para regravar a tabela de inodos entre dois
+    // checkpoints: gravar um inodo não pode falhar por falta de espaço
+    static const int LOG_RESERVE = 16;
 
     class fs_superblock
     {
@@ -18,6 +101,17 @@ public:
         int nblocks;
         int ninodeblocks;
         int ninodes;
+        // Zero em imagens antigas, que usam sempre blocos de 4 KiB
+        int block_size;
+        // Blocos por grupo; zero quando a tabela de inodos fica toda no início
+        int group_blocks;
+        // Blocos do fim da tabela de inodos ainda não zerados pela formatação rápida
+        int inode_blocks_uninit;
+        // Blocos por segmento no modo de log; zero com atualização no lugar
+        int segment_blocks;
+        // Largura dos ponteiros de bloco dos inodos e blocos indiretos, em bytes
+        // (zero nas imagens antigas, que usam 4)
+        int pointer_bytes;
     };
 
     class fs_inode
@@ -29,37 +123,187 @@ public:
         int indirect;
     };
 
+    // Cabeçalho de um checkpoint do modo de log, seguido pelos blocos do imap
+    class fs_checkpoint
+    {
+    public:
+        unsigned int magic;
+        int sequence;
+        int log_head;
+    };
+
     union fs_block
     {
     public:
         fs_superblock super;
+        fs_checkpoint checkpoint;
         fs_inode inode[INODES_PER_BLOCK];
         int pointers[POINTERS_PER_BLOCK];
-        char data[Disk::DISK_BLOCK_SIZE];
+        char data[BLOCK_SIZE];
+    };
+
+    // Bloco emprestado do pool de buffers do disco, no lugar de um fs_block na pilha
+    class pooled_block : public Disk::buffer
+    {
+    public:
+        pooled_block(Disk *d) : Disk::buffer(d) {}
+        fs_block &operator*() { return *(fs_block *)data; }
     };
 
 public:
-    INE5412_FS(Disk *d)
+    INE5412_FS_Impl(Disk *d)
     {
         disk = d;
     }
+    ~INE5412_FS_Impl();
 
     void fs_debug();
     int fs_format();
+    int fs_format_groups(int group_blocks);
+    int fs_format_lazy(int group_blocks);
+    int fs_format_log();
     int fs_mount();
 
     int fs_create();
+    int fs_create_dir();
     int fs_delete(int inumber);
     int fs_getsize(int inumber);
+    int fs_gettype(int inumber);
 
     int fs_read(int inumber, char *data, int length, int offset);
     int fs_write(int inumber, const char *data, int length, int offset);
 
+    int fs_truncate(int inumber, int newsize);
+    int fs_fallocate(int inumber, int offset, int length);
+
+    int fs_clone(int src_inumber);
+    int fs_snapshot();
+
+    void fs_set_delalloc(bool enabled);
+    int fs_sync();
+
 private:
+    // Dados de um inodo escritos com alocação adiada e ainda não descarregados
+    class fs_dirty
+    {
+    public:
+        int size = 0;
+        int reserved = 0;
+        bool indirect_reserved = false;
+        std::map<int, std::vector<char>> blocks;
+    };
+
     Disk *disk;
     bool is_mounted = false;
+    int ninodes = 0;
+    // Número de referências a cada bloco de dados ou indireto; um bloco
+    // com mais de uma referência é compartilhado por clones (copy-on-write)
+    std::vector<int> refcount;
+    // meta_mutex protege o mapa de blocos livres e a tabela de inodos;
+    // inode_mutexes serializa operações sobre um mesmo inodo
+    std::mutex meta_mutex;
+    std::mutex inode_mutexes[INODE_LOCKS];
+    std::mutex &inode_lock(int inumber);
+
+    // Divisão do disco em grupos, cada um começando pela sua fatia da tabela
+    // de inodos. Sem grupos, o disco inteiro é tratado como um grupo só.
+    int ngroups = 1;
+    int group_blocks = 0;
+    int group_inode_blocks = 0;
+    // Blocos e inodos livres em cada grupo
+    std::vector<int> group_free;
+    std::vector<int> group_free_inodes;
+    void set_layout(const fs_superblock &super);
+    int group_start(int group);
+    int group_end(int group);
+    int group_of(int block);
+    int inode_block(int index);
+    int inode_group(int inumber);
+
+    int format(int group_blocks, bool lazy, bool log);
+
+    // Formatação rápida: só os primeiros inode_ready blocos da tabela de inodos
+    // (por índice) estão zerados; os demais são tratados como vazios e zerados
+    // sob demanda por fs_create, ou pela thread de inicialização iniciada na montagem.
+    // inode_ready é protegido por meta_mutex.
+    static const int INIT_CHUNK = (1 << 20) / BLOCK_SIZE;
+    int inode_ready = 0;
+    int ninodeblocks = 0;
+    std::thread initializer;
+    std::atomic<bool> initializer_stop{false};
+    int inode_table_init(int upto);
+    void initializer_run();
+    void inode_table_read(int index, fs_block &block);
+    int inode_table_write(int index, const fs_block &block);
+
+    // Modo de log, no estilo do LFS: todo bloco escrito, inclusive os da tabela de
+    // inodos, vai para uma posição nova no segmento corrente do log. imap diz onde
+    // está cada bloco da tabela de inodos (zero se nunca foi escrito) e é gravado
+    // nos checkpoints, que alternam entre duas posições no início do disco.
+    // Os blocos liberados ficam em "dead" até o checkpoint seguinte, para que o
+    // checkpoint anterior continue apontando para blocos intactos.
+    // O limpador copia os blocos vivos dos segmentos quase vazios para o fim do log.
+    // Protegido por meta_mutex.
+    int segment_blocks = 0;
+    int imap_blocks = 0;
+    std::vector<int> imap;
+    std::vector<int> dead;
+    // Blocos ocupados (inclusive os mortos) e blocos vivos de cada segmento
+    std::vector<int> segment_used;
+    std::vector<int> segment_live;
+    int log_head = 0;
+    int checkpoint_seq = 0;
+    // Blocos da tabela de inodos regravados desde o último checkpoint
+    int table_rewrites = 0;
+    std::thread cleaner;
+    std::mutex cleaner_mutex;
+    std::condition_variable cleaner_wakeup;
+    bool cleaner_stop = false;
+    int log_start();
+    int segment_start(int segment);
+    int segment_of(int block);
+    int log_next(bool metadata = false);
+    int checkpoint_write();
+    int checkpoint_read();
+    void lock_inodes();
+    void unlock_inodes();
+    void cleaner_run();
+    int log_reserve();
+    void log_reclaim();
+    void log_clean();
+    int segment_clean(int segment);
+
     void set_bitmap(Disk *disk);
-    int allocate_block();
+    void block_take(int block);
+    void block_free(int block);
+    bool overwrite_in_place(int block);
+    int allocate_block(int inumber);
+    int allocate_run(int inumber, int wanted, int &start);
+    void release_blocks(const std::vector<int> &blocks);
+    int release_block(int block);
+    void block_ref(const std::vector<int> &blocks);
+    int block_refs(int block);
+    int indirect_private(int inumber, fs_inode &inode, const fs_block &indirect_block);
+
+    bool delalloc = false;
+    std::map<int, fs_dirty> dirty;
+    std::mutex dirty_mutex;
+    std::atomic<int> ndirty{0};
+    // Blocos livres e blocos prometidos a dados com alocação adiada
+    int nfree = 0;
+    int nreserved = 0;
+    int write_delayed(int inumber, const fs_inode &inode, const char *data, int length, int offset);
+    int flush_inode(int inumber);
+    fs_dirty *dirty_find(int inumber);
+    const char *dirty_block(fs_dirty *pending, int block_rel);
+    void dirty_discard(int inumber);
+    int reserve_blocks(int count);
+    void unreserve_blocks(int count);
+    int block_map(const fs_inode &inode, const fs_block &indirect_block, int block_rel);
+    int inode_load(int inumber, fs_inode &inode);
+    int inode_create(int type);
+    int inode_clone(int src_inumber);
+    int inode_save(int inumber, const fs_inode &inode);
 };
 
 #endif
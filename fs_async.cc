@@ -0,0 +1,140 @@
+#include "fs_async.h"
+
+FS_Async::FS_Async(INE5412_FS *f, int nworkers)
+{
+	fs = f;
+	if (nworkers < 1)
+		nworkers = 1;
+
+	for (int i = 0; i < nworkers; i++)
+	{
+		worker *w = new worker;
+		workers.push_back(w);
+	}
+	for (std::size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i]->thread = std::thread(&FS_Async::worker_loop, this, workers[i]);
+	}
+}
+
+FS_Async::~FS_Async()
+{
+	// Termina as requisições já enviadas antes de parar as threads
+	drain();
+
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		stopping = true;
+	}
+	for (std::size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i]->wakeup.notify_all();
+		workers[i]->thread.join();
+		delete workers[i];
+	}
+}
+
+int FS_Async::fs_read_async(int inumber, char *data, int length, int offset, callback cb)
+{
+	fs_request req;
+	req.done.op = OP_READ;
+	req.done.inumber = inumber;
+	req.rdata = data;
+	req.wdata = 0;
+	req.length = length;
+	req.offset = offset;
+	req.cb = cb;
+	return submit(req);
+}
+
+int FS_Async::fs_write_async(int inumber, const char *data, int length, int offset, callback cb)
+{
+	fs_request req;
+	req.done.op = OP_WRITE;
+	req.done.inumber = inumber;
+	req.rdata = 0;
+	req.wdata = data;
+	req.length = length;
+	req.offset = offset;
+	req.cb = cb;
+	return submit(req);
+}
+
+int FS_Async::submit(fs_request &req)
+{
+	// Um mesmo inodo é sempre atendido pela mesma thread, preservando a ordem
+	worker *w = workers[(unsigned int)req.done.inumber % workers.size()];
+
+	std::lock_guard<std::mutex> guard(mutex);
+	req.done.ticket = next_ticket++;
+	req.done.result = 0;
+	in_flight++;
+	w->queue.push_back(req);
+	w->wakeup.notify_one();
+	return req.done.ticket;
+}
+
+void FS_Async::worker_loop(worker *w)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		w->wakeup.wait(lock, [&] { return stopping || !w->queue.empty(); });
+		if (w->queue.empty())
+			break;
+
+		fs_request req = w->queue.front();
+		w->queue.pop_front();
+
+		// A E/S de blocos acontece fora da trava da fila
+		lock.unlock();
+		if (req.done.op == OP_READ)
+			req.done.result = fs->fs_read(req.done.inumber, req.rdata, req.length, req.offset);
+		else
+			req.done.result = fs->fs_write(req.done.inumber, req.wdata, req.length, req.offset);
+
+		if (req.cb)
+			req.cb(req.done);
+		lock.lock();
+
+		if (!req.cb)
+			completions.push_back(req.done);
+		in_flight--;
+		completed.notify_all();
+	}
+}
+
+bool FS_Async::poll(fs_completion &c)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	if (completions.empty())
+		return false;
+
+	c = completions.front();
+	completions.pop_front();
+	return true;
+}
+
+bool FS_Async::wait(fs_completion &c)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	completed.wait(lock, [&] { return !completions.empty() || in_flight == 0; });
+	if (completions.empty())
+		return false;
+
+	c = completions.front();
+	completions.pop_front();
+	return true;
+}
+
+void FS_Async::drain()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	completed.wait(lock, [&] { return in_flight == 0; });
+}
+
+int FS_Async::pending()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return in_flight;
+}
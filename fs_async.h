@@ -0,0 +1,85 @@
+#ifndef FS_ASYNC_H
+#define FS_ASYNC_H
+
+#include "fs.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+
+// Interface assíncrona para fs_read/fs_write.
+// As requisições são distribuídas entre um pequeno conjunto de threads de E/S
+// pelo inúmero: requisições a um mesmo inodo são atendidas na ordem de envio
+// pela mesma thread, enquanto requisições a inodos diferentes executam em paralelo.
+// Cada requisição concluída gera um fs_completion, que é entregue à callback
+// (se houver) ou colocado na fila de conclusões para poll()/wait().
+class FS_Async
+{
+public:
+    static const int OP_READ = 0;
+    static const int OP_WRITE = 1;
+
+    class fs_completion
+    {
+    public:
+        int ticket;
+        int op;
+        int inumber;
+        int result;
+    };
+
+    typedef std::function<void(const fs_completion &)> callback;
+
+    FS_Async(INE5412_FS *fs, int nworkers = 4);
+    ~FS_Async();
+
+    // Retornam o ticket que identifica a requisição na fila de conclusões.
+    // "data" deve permanecer válido até a conclusão.
+    int fs_read_async(int inumber, char *data, int length, int offset, callback cb = nullptr);
+    int fs_write_async(int inumber, const char *data, int length, int offset, callback cb = nullptr);
+
+    // Retira uma conclusão da fila sem bloquear; retorna false se a fila estiver vazia.
+    bool poll(fs_completion &c);
+    // Bloqueia até que haja uma conclusão na fila; retorna false se não houver
+    // nenhuma requisição pendente que possa gerá-la.
+    bool wait(fs_completion &c);
+    // Bloqueia até que todas as requisições enviadas tenham sido concluídas.
+    void drain();
+
+    int pending();
+
+private:
+    class fs_request
+    {
+    public:
+        fs_completion done;
+        char *rdata;
+        const char *wdata;
+        int length;
+        int offset;
+        callback cb;
+    };
+
+    class worker
+    {
+    public:
+        std::thread thread;
+        std::deque<fs_request> queue;
+        std::condition_variable wakeup;
+    };
+
+    int submit(fs_request &req);
+    void worker_loop(worker *w);
+
+    INE5412_FS *fs;
+    std::vector<worker *> workers;
+    std::mutex mutex;
+    std::condition_variable completed;
+    std::deque<fs_completion> completions;
+    int next_ticket = 1;
+    int in_flight = 0;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,603 @@
+#include "fs_dir.h"
+
+#include <cstring>
+
+FS_Dir::FS_Dir(INE5412_FS *f)
+{
+	fs = f;
+}
+
+// Cria o diretório raiz. Ele precisa ser o primeiro inodo criado após a
+// formatação, para que ocupe o inúmero ROOT_INUMBER.
+// Retorna 1 em caso de sucesso, 0 caso contrário.
+int FS_Dir::mkroot()
+{
+	int inumber = fs->fs_create_dir();
+	if (inumber == 0)
+	{
+		return 0;
+	}
+	if (inumber != ROOT_INUMBER)
+	{
+		fs->fs_delete(inumber);
+		if (is_dir(ROOT_INUMBER))
+			cout << "ERROR: o diretório raiz já existe.\n";
+		else
+			cout << "ERROR: o inodo " << ROOT_INUMBER << " já está em uso.\n";
+		return 0;
+	}
+
+	if (!dir_init(inumber, inumber))
+	{
+		fs->fs_delete(inumber);
+		return 0;
+	}
+	return 1;
+}
+
+// Cria um diretório vazio com o nome indicado dentro de "dir".
+// Retorna o inúmero do novo diretório, ou 0 em caso de falha.
+int FS_Dir::mkdir(int dir, const char *name)
+{
+	if (!is_dir(dir))
+	{
+		cout << "ERROR: inodo " << dir << " não é um diretório.\n";
+		return 0;
+	}
+
+	int inumber = fs->fs_create_dir();
+	if (inumber == 0)
+	{
+		return 0;
+	}
+
+	if (!dir_init(inumber, dir) || !entry_add(dir, name, inumber))
+	{
+		fs->fs_delete(inumber);
+		return 0;
+	}
+	return inumber;
+}
+
+// Retorna 1 se o inodo é um diretório (INODE_DIR) com um cabeçalho válido.
+int FS_Dir::is_dir(int inumber)
+{
+	fs_dirhead head;
+	return head_load(inumber, head);
+}
+
+// Procura o nome no diretório.
+// Retorna o inúmero da entrada, ou 0 se ela não existir.
+int FS_Dir::lookup(int dir, const char *name)
+{
+	if (!valid_name(name))
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(mutex);
+	return lookup_locked(dir, name);
+}
+
+// Acrescenta ao diretório uma entrada com o nome indicado apontando para o inodo.
+// Diretórios têm um único nome, dado por mkdir, e não aceitam outros.
+// Retorna 1 em caso de sucesso, 0 caso contrário.
+int FS_Dir::link(int dir, const char *name, int inumber)
+{
+	int type = inumber > 0 ? fs->fs_gettype(inumber) : 0;
+	if (type == 0)
+	{
+		cout << "ERROR: inodo inválido.\n";
+		return 0;
+	}
+	if (type == INE5412_FS::INODE_DIR)
+	{
+		cout << "ERROR: inodo " << inumber << " é um diretório.\n";
+		return 0;
+	}
+	return entry_add(dir, name, inumber);
+}
+
+// Corpo de link, também usado por mkdir para dar nome ao novo diretório.
+int FS_Dir::entry_add(int dir, const char *name, int inumber)
+{
+	if (!valid_name(name))
+	{
+		cout << "ERROR: nome inválido: " << name << "\n";
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(mutex);
+	nlinks_load();
+
+	fs_dirhead head;
+	if (!head_load(dir, head))
+	{
+		cout << "ERROR: inodo " << dir << " não é um diretório.\n";
+		return 0;
+	}
+
+	while (true)
+	{
+		int bucket = hash(name) % head.nbuckets;
+		union fs_bucket b;
+		if (!bucket_load(dir, bucket, b))
+		{
+			return 0;
+		}
+
+		// O nome só pode estar no seu balde, então basta percorrê-lo
+		int slot = -1;
+		for (int i = 0; i < ENTRIES_PER_BUCKET; i++)
+		{
+			if (b.entries[i].inumber == 0)
+			{
+				if (slot < 0)
+					slot = i;
+			}
+			else if (!strcmp(b.entries[i].name, name))
+			{
+				cout << "ERROR: " << name << " já existe.\n";
+				return 0;
+			}
+		}
+
+		if (slot < 0)
+		{
+			// Balde cheio: dobra a tabela e tenta de novo
+			if (!grow(dir, head))
+			{
+				return 0;
+			}
+			continue;
+		}
+
+		fs_dirent entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.inumber = inumber;
+		strcpy(entry.name, name);
+		int offset = (1 + bucket) * BUCKET_SIZE + slot * sizeof(fs_dirent);
+		if (fs->fs_write(dir, (const char *)&entry, sizeof(entry), offset) != sizeof(entry))
+		{
+			return 0;
+		}
+
+		head.nentries++;
+		head_save(dir, head);
+		nlinks[inumber]++;
+
+		if (dcache.size() >= (std::size_t)DCACHE_MAX)
+			dcache.clear();
+		dcache[dcache_key(dir, name)] = inumber;
+		return 1;
+	}
+}
+
+// Remove a entrada do diretório. O inodo para o qual ela apontava é liberado
+// com fs_delete quando esta era o seu último nome.
+// Diretórios só podem ser removidos quando estão vazios.
+// Retorna 1 em caso de sucesso, 0 caso contrário.
+int FS_Dir::unlink(int dir, const char *name)
+{
+	if (!valid_name(name))
+	{
+		cout << "ERROR: nome inválido: " << name << "\n";
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(mutex);
+	nlinks_load();
+
+	fs_dirhead head;
+	if (!head_load(dir, head))
+	{
+		cout << "ERROR: inodo " << dir << " não é um diretório.\n";
+		return 0;
+	}
+
+	int bucket = hash(name) % head.nbuckets;
+	union fs_bucket b;
+	if (!bucket_load(dir, bucket, b))
+	{
+		return 0;
+	}
+
+	int slot = -1;
+	for (int i = 0; i < ENTRIES_PER_BUCKET; i++)
+	{
+		if (b.entries[i].inumber != 0 && !strcmp(b.entries[i].name, name))
+		{
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0)
+	{
+		cout << "ERROR: " << name << " não encontrado.\n";
+		return 0;
+	}
+
+	fs_dirhead target;
+	if (head_load(b.entries[slot].inumber, target) && target.nentries > 0)
+	{
+		cout << "ERROR: o diretório " << name << " não está vazio.\n";
+		return 0;
+	}
+
+	int inumber = b.entries[slot].inumber;
+	fs_dirent entry;
+	memset(&entry, 0, sizeof(entry));
+	int offset = (1 + bucket) * BUCKET_SIZE + slot * sizeof(fs_dirent);
+	if (fs->fs_write(dir, (const char *)&entry, sizeof(entry), offset) != sizeof(entry))
+	{
+		return 0;
+	}
+
+	head.nentries--;
+	head_save(dir, head);
+	dcache.erase(dcache_key(dir, name));
+
+	// Só libera o inodo uma entrada que foi contada e que ainda aponta para um
+	// inodo em uso; uma entrada fora da contagem apenas perde o nome
+	std::unordered_map<int, int>::iterator it = nlinks.find(inumber);
+	if (it == nlinks.end() || fs->fs_gettype(inumber) == 0)
+	{
+		return 1;
+	}
+	if (--it->second <= 0)
+	{
+		nlinks.erase(it);
+		// A raiz existe mesmo sem nomes
+		if (inumber != ROOT_INUMBER)
+			fs->fs_delete(inumber);
+	}
+	return 1;
+}
+
+// Retorna o número de nomes que apontam para o inodo.
+int FS_Dir::nlink(int inumber)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	nlinks_load();
+
+	std::unordered_map<int, int>::iterator it = nlinks.find(inumber);
+	return it == nlinks.end() ? 0 : it->second;
+}
+
+// Lista as entradas do diretório, na ordem da tabela hash.
+// Retorna o número de entradas, ou -1 se o inodo não for um diretório.
+int FS_Dir::readdir(int dir, std::vector<fs_dirent> &entries)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return readdir_locked(dir, entries);
+}
+
+int FS_Dir::readdir_locked(int dir, std::vector<fs_dirent> &entries)
+{
+	fs_dirhead head;
+	if (!head_load(dir, head))
+	{
+		return -1;
+	}
+
+	std::vector<char> table((std::size_t)head.nbuckets * BUCKET_SIZE);
+	int bytes = fs->fs_read(dir, table.data(), table.size(), BUCKET_SIZE);
+	if (bytes != (int)table.size())
+	{
+		return -1;
+	}
+
+	entries.clear();
+	const fs_bucket *buckets = (const fs_bucket *)table.data();
+	for (int i = 0; i < head.nbuckets; i++)
+	{
+		for (int j = 0; j < ENTRIES_PER_BUCKET; j++)
+		{
+			if (buckets[i].entries[j].inumber != 0)
+				entries.push_back(buckets[i].entries[j]);
+		}
+	}
+	return entries.size();
+}
+
+int FS_Dir::resolve(const char *path)
+{
+	if (path[0] != '/')
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(mutex);
+
+	fs_dirhead head;
+	int inumber = ROOT_INUMBER;
+	if (!head_load(inumber, head))
+	{
+		return 0;
+	}
+
+	std::string rest(path);
+	std::size_t pos = 0;
+	while (pos < rest.size())
+	{
+		std::size_t next = rest.find('/', pos);
+		if (next == std::string::npos)
+			next = rest.size();
+		std::string component = rest.substr(pos, next - pos);
+		pos = next + 1;
+
+		if (component.empty() || component == ".")
+		{
+			continue;
+		}
+		if (component == "..")
+		{
+			if (!head_load(inumber, head))
+				return 0;
+			inumber = head.parent;
+			continue;
+		}
+
+		inumber = valid_name(component.c_str()) ? lookup_locked(inumber, component.c_str()) : 0;
+		if (inumber == 0)
+		{
+			return 0;
+		}
+	}
+	return inumber;
+}
+
+int FS_Dir::resolve_parent(const char *path, std::string &name)
+{
+	if (path[0] != '/')
+	{
+		return 0;
+	}
+
+	std::string full(path);
+	std::size_t last = full.find_last_of('/');
+	name = full.substr(last + 1);
+	if (!valid_name(name.c_str()) || name == "." || name == "..")
+	{
+		return 0;
+	}
+
+	std::string parent = last == 0 ? "/" : full.substr(0, last);
+	return resolve(parent.c_str());
+}
+
+// Retorna o número de baldes da tabela do diretório, ou -1 se não for um diretório.
+int FS_Dir::buckets(int dir)
+{
+	fs_dirhead head;
+	if (!head_load(dir, head))
+	{
+		return -1;
+	}
+	return head.nbuckets;
+}
+
+void FS_Dir::dcache_drop()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	dcache.clear();
+}
+
+void FS_Dir::reset()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	dcache.clear();
+	nlinks.clear();
+	nlinks_ready = false;
+}
+
+long FS_Dir::dcache_hits()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return hits;
+}
+
+long FS_Dir::dcache_misses()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	return misses;
+}
+
+// FNV-1a de 32 bits
+unsigned int FS_Dir::hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+	{
+		h ^= *p;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int FS_Dir::valid_name(const char *name)
+{
+	std::size_t length = strlen(name);
+	return length > 0 && length <= (std::size_t)MAX_NAME && strchr(name, '/') == 0;
+}
+
+std::string FS_Dir::dcache_key(int dir, const char *name)
+{
+	return std::to_string(dir) + '/' + name;
+}
+
+// Transforma o inodo recém criado num diretório vazio com um balde.
+// O balde é um buraco no arquivo, lido como zeros (entradas livres).
+int FS_Dir::dir_init(int inumber, int parent)
+{
+	fs_dirhead head;
+	head.magic = DIR_MAGIC;
+	head.nbuckets = 1;
+	head.nentries = 0;
+	head.parent = parent;
+	return fs->fs_truncate(inumber, 2 * BUCKET_SIZE) && head_save(inumber, head);
+}
+
+// Lê o cabeçalho do diretório. Retorna 0 se o inodo não for um diretório:
+// o tipo vem do inodo, e não do conteúdo, que um arquivo comum pode imitar.
+// Também retorna 0 se o cabeçalho estiver corrompido: nbuckets tem de ser uma
+// potência de dois até MAX_BUCKETS, e a tabela tem de caber no arquivo, pois
+// os percursos dos baldes confiam nele.
+int FS_Dir::head_load(int dir, fs_dirhead &head)
+{
+	if (dir <= 0 || fs->fs_gettype(dir) != INE5412_FS::INODE_DIR)
+	{
+		return 0;
+	}
+	if (fs->fs_read(dir, (char *)&head, sizeof(head), 0) != sizeof(head))
+	{
+		return 0;
+	}
+	if (head.magic != DIR_MAGIC || head.nbuckets <= 0 || head.nbuckets > MAX_BUCKETS)
+	{
+		return 0;
+	}
+	if ((head.nbuckets & (head.nbuckets - 1)) != 0)
+	{
+		return 0;
+	}
+	return (long)(1 + head.nbuckets) * BUCKET_SIZE <= fs->fs_getsize(dir);
+}
+
+int FS_Dir::head_save(int dir, const fs_dirhead &head)
+{
+	return fs->fs_write(dir, (const char *)&head, sizeof(head), 0) == sizeof(head);
+}
+
+int FS_Dir::bucket_load(int dir, int bucket, fs_bucket &b)
+{
+	return fs->fs_read(dir, b.data, BUCKET_SIZE, (1 + bucket) * BUCKET_SIZE) == BUCKET_SIZE;
+}
+
+// Dobra o número de baldes e redistribui as entradas. Se algum balde ainda
+// transbordar, dobra de novo. Retorna 0 se a tabela não puder crescer.
+int FS_Dir::grow(int dir, fs_dirhead &head)
+{
+	std::vector<char> old((std::size_t)head.nbuckets * BUCKET_SIZE);
+	if (fs->fs_read(dir, old.data(), old.size(), BUCKET_SIZE) != (int)old.size())
+	{
+		return 0;
+	}
+	const fs_bucket *old_buckets = (const fs_bucket *)old.data();
+
+	std::vector<char> table;
+	for (int nbuckets = 2 * head.nbuckets; nbuckets <= MAX_BUCKETS; nbuckets *= 2)
+	{
+		table.assign((std::size_t)nbuckets * BUCKET_SIZE, 0);
+		fs_bucket *buckets = (fs_bucket *)table.data();
+		std::vector<int> used(nbuckets, 0);
+		bool overflow = false;
+
+		for (int i = 0; i < head.nbuckets && !overflow; i++)
+		{
+			for (int j = 0; j < ENTRIES_PER_BUCKET && !overflow; j++)
+			{
+				const fs_dirent &entry = old_buckets[i].entries[j];
+				if (entry.inumber == 0)
+					continue;
+				int bucket = hash(entry.name) % nbuckets;
+				if (used[bucket] == ENTRIES_PER_BUCKET)
+				{
+					overflow = true;
+					break;
+				}
+				buckets[bucket].entries[used[bucket]++] = entry;
+			}
+		}
+		if (overflow)
+		{
+			continue;
+		}
+
+		if (fs->fs_write(dir, table.data(), table.size(), BUCKET_SIZE) != (int)table.size())
+		{
+			// O arquivo chegou ao tamanho máximo ou o disco está cheio; a tabela
+			// antiga é restaurada para que nenhuma entrada se perca
+			fs->fs_write(dir, old.data(), old.size(), BUCKET_SIZE);
+			cout << "ERROR: não foi possível aumentar o diretório " << dir << ".\n";
+			return 0;
+		}
+		head.nbuckets = nbuckets;
+		return head_save(dir, head);
+	}
+
+	cout << "ERROR: o diretório " << dir << " atingiu o número máximo de baldes.\n";
+	return 0;
+}
+
+int FS_Dir::lookup_locked(int dir, const char *name)
+{
+	std::string key = dcache_key(dir, name);
+	std::unordered_map<std::string, int>::iterator it = dcache.find(key);
+	if (it != dcache.end())
+	{
+		hits++;
+		return it->second;
+	}
+	misses++;
+
+	fs_dirhead head;
+	if (!head_load(dir, head))
+	{
+		return 0;
+	}
+
+	union fs_bucket b;
+	if (!bucket_load(dir, hash(name) % head.nbuckets, b))
+	{
+		return 0;
+	}
+	for (int i = 0; i < ENTRIES_PER_BUCKET; i++)
+	{
+		if (b.entries[i].inumber != 0 && !strcmp(b.entries[i].name, name))
+		{
+			if (dcache.size() >= (std::size_t)DCACHE_MAX)
+				dcache.clear();
+			dcache[key] = b.entries[i].inumber;
+			return b.entries[i].inumber;
+		}
+	}
+	return 0;
+}
+
+// Conta os nomes de cada inodo percorrendo a árvore a partir da raiz. Um
+// diretório com mais de um nome é percorrido uma única vez.
+// O chamador detém o mutex.
+void FS_Dir::nlinks_load()
+{
+	if (nlinks_ready)
+	{
+		return;
+	}
+	nlinks.clear();
+	nlinks_ready = true;
+
+	int root = ROOT_INUMBER;
+	std::vector<int> pending(1, root);
+	std::unordered_map<int, bool> visited;
+	visited[root] = true;
+	std::vector<fs_dirent> entries;
+	while (!pending.empty())
+	{
+		int dir = pending.back();
+		pending.pop_back();
+		if (readdir_locked(dir, entries) < 0)
+		{
+			continue;
+		}
+		for (std::size_t i = 0; i < entries.size(); i++)
+		{
+			int inumber = entries[i].inumber;
+			if (nlinks[inumber]++ == 0 && !visited[inumber])
+			{
+				visited[inumber] = true;
+				pending.push_back(inumber);
+			}
+		}
+	}
+}
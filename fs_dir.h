@@ -0,0 +1,111 @@
+#ifndef FS_DIR_H
+#define FS_DIR_H
+
+#include "fs.h"
+
+#include <string>
+#include <unordered_map>
+
+// Camada de diretórios sobre o INE5412_FS.
+// Um diretório é um inodo do tipo INODE_DIR cujo conteúdo é uma tabela hash de
+// entradas dividida em baldes de BUCKET_SIZE bytes, precedida por um cabeçalho:
+//
+//     [ cabeçalho | balde 0 | balde 1 | ... | balde nbuckets-1 ]
+//
+// O balde de um nome é hash(nome) % nbuckets, de modo que lookup, link e unlink
+// leem apenas o cabeçalho e um balde, qualquer que seja o tamanho do diretório.
+// Quando o balde de um novo nome está cheio, a tabela dobra de tamanho e as
+// entradas são redistribuídas.
+// O diretório raiz é sempre o inodo ROOT_INUMBER, criado por mkroot() logo
+// após a formatação. Os nomes resolvidos ficam num cache em memória (dentry cache).
+// Um arquivo pode ter vários nomes (link), um diretório só o seu; o número de
+// nomes de cada inodo não é gravado no disco, mas contado percorrendo a árvore
+// no primeiro uso, e o inodo só é liberado quando unlink remove o último deles.
+class FS_Dir
+{
+public:
+    static const unsigned int DIR_MAGIC = 0xd1d1f5a1;
+    static const int ROOT_INUMBER = 1;
+    static const int BUCKET_SIZE = 4096;
+    static const int MAX_NAME = 59;
+    // Limite de baldes por diretório (256 MiB de tabela)
+    static const int MAX_BUCKETS = 65536;
+    // Número máximo de nomes no dentry cache; ao atingi-lo, o cache é esvaziado
+    static const int DCACHE_MAX = 8192;
+
+    class fs_dirent
+    {
+    public:
+        int inumber;
+        char name[MAX_NAME + 1];
+    };
+
+    static const int ENTRIES_PER_BUCKET = BUCKET_SIZE / sizeof(fs_dirent);
+
+    FS_Dir(INE5412_FS *fs);
+
+    int mkroot();
+    int mkdir(int dir, const char *name);
+    int is_dir(int inumber);
+
+    int lookup(int dir, const char *name);
+    int link(int dir, const char *name, int inumber);
+    int unlink(int dir, const char *name);
+    int nlink(int inumber);
+    int readdir(int dir, std::vector<fs_dirent> &entries);
+
+    // Resolvem caminhos absolutos ("/a/b/c"), aceitando "." e "..".
+    int resolve(const char *path);
+    // Resolve o diretório que contém o último componente, devolvido em "name".
+    int resolve_parent(const char *path, std::string &name);
+
+    int buckets(int dir);
+    void dcache_drop();
+    // Esquece o estado em memória de outro sistema de arquivos (após format ou mount)
+    void reset();
+    long dcache_hits();
+    long dcache_misses();
+
+private:
+    class fs_dirhead
+    {
+    public:
+        unsigned int magic;
+        int nbuckets;
+        int nentries;
+        int parent;
+    };
+
+    union fs_bucket
+    {
+    public:
+        fs_dirent entries[ENTRIES_PER_BUCKET];
+        char data[BUCKET_SIZE];
+    };
+
+    static unsigned int hash(const char *name);
+    static int valid_name(const char *name);
+    static std::string dcache_key(int dir, const char *name);
+
+    int dir_init(int inumber, int parent);
+    int head_load(int dir, fs_dirhead &head);
+    int head_save(int dir, const fs_dirhead &head);
+    int bucket_load(int dir, int bucket, fs_bucket &b);
+    int grow(int dir, fs_dirhead &head);
+    int entry_add(int dir, const char *name, int inumber);
+    int lookup_locked(int dir, const char *name);
+    int readdir_locked(int dir, std::vector<fs_dirent> &entries);
+    void nlinks_load();
+
+    INE5412_FS *fs;
+    // Serializa as alterações nos diretórios e o acesso ao cache
+    std::mutex mutex;
+    std::unordered_map<std::string, int> dcache;
+    // Número de nomes de cada inodo; válido quando nlinks_ready
+    std::unordered_map<int, int> nlinks;
+    bool nlinks_ready = false;
+    long hits = 0;
+    long misses = 0;
+};
+
+#endif
@@ -0,0 +1,357 @@
+#include "fs.h"
+#include "fs_dir.h"
+#include "disk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+// Gera uma imagem do simplefs a partir de uma árvore de diretórios do hospedeiro.
+// Em vez de um copyin por arquivo, todo o leiaute é decidido antes de qualquer
+// escrita: cada arquivo recebe um inodo e uma sequência contígua de blocos (o bloco
+// indireto, se houver, seguido dos dados), e a tabela de inodos é montada em memória.
+// A área de dados é então preenchida em lotes de blocos consecutivos: várias threads
+// leem os arquivos do hospedeiro, e cada lote vai para o disco numa única escrita.
+// Por fim a imagem é montada e os diretórios são criados com FS_Dir.
+// O inodo 1 fica livre para o diretório raiz.
+
+class host_file
+{
+public:
+	std::string host_path;
+	// Caminho dentro da imagem ("/a/b")
+	std::string path;
+	long size;
+	int inumber;
+	int indirect;
+	int first;
+	int nblocks;
+};
+
+// Tamanho de cada lote da área de dados
+static const int BATCH_BYTES = 8 * 1024 * 1024;
+
+static int scan(const std::string &host, const std::string &path, std::vector<std::string> &dirs, std::vector<host_file> &files)
+{
+	DIR *d = opendir(host.c_str());
+	if (!d)
+	{
+		cout << "couldn't open directory " << host << "\n";
+		return 0;
+	}
+
+	std::vector<std::string> names;
+	while (struct dirent *e = readdir(d))
+	{
+		if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+			names.push_back(e->d_name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	for (std::size_t i = 0; i < names.size(); i++)
+	{
+		std::string host_path = host + "/" + names[i];
+		std::string image_path = path + "/" + names[i];
+		struct stat st;
+		if (lstat(host_path.c_str(), &st) != 0)
+			continue;
+		if (names[i].size() > (std::size_t)FS_Dir::MAX_NAME)
+		{
+			cout << "WARNING: skipping " << host_path << ": name too long\n";
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode))
+		{
+			dirs.push_back(image_path);
+			if (!scan(host_path, image_path, dirs, files))
+				return 0;
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			host_file f;
+			f.host_path = host_path;
+			f.path = image_path;
+			f.size = st.st_size;
+			files.push_back(f);
+		}
+	}
+	return 1;
+}
+
+// Preenche os blocos [start, start + count) da área de dados.
+// "files" está na ordem do leiaute, então os arquivos que caem no lote são consecutivos.
+template <class G>
+static int fill_batch(const std::vector<host_file> &files, int start, int count, char *buf)
+{
+	typedef typename INE5412_FS_Impl<G>::fs_block fs_block;
+	const int B = G::BLOCK_SIZE;
+	int end = start + count;
+
+	// Primeiro arquivo cuja sequência termina depois do início do lote
+	std::size_t i = std::upper_bound(files.begin(), files.end(), start, [](int block, const host_file &f) {
+		return block < f.first + f.nblocks;
+	}) - files.begin();
+
+	for (; i < files.size(); i++)
+	{
+		const host_file &f = files[i];
+		int run_start = f.indirect ? f.indirect : f.first;
+		if (run_start >= end)
+			break;
+
+		if (f.indirect >= start && f.indirect < end)
+		{
+			fs_block *indirect = (fs_block *)(buf + (long)(f.indirect - start) * B);
+			for (int k = G::POINTERS_PER_INODE; k < f.nblocks; k++)
+			{
+				indirect->pointers[k - G::POINTERS_PER_INODE] = f.first + k;
+			}
+		}
+
+		int first = std::max(f.first, start);
+		int last = std::min(f.first + f.nblocks, end);
+		if (first >= last)
+			continue;
+
+		int fd = open(f.host_path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			cout << "couldn't open " << f.host_path << "\n";
+			return 0;
+		}
+		// O final do último bloco continua zerado
+		long offset = (long)(first - f.first) * B;
+		long length = std::min((long)(last - first) * B, f.size - offset);
+		long done = 0;
+		while (done < length)
+		{
+			ssize_t n = pread(fd, buf + (long)(first - start) * B + done, length - done, offset + done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		close(fd);
+	}
+	return 1;
+}
+
+template <class G>
+static int build(Disk *disk, std::vector<host_file> &files, long &bytes, int nthreads)
+{
+	typedef INE5412_FS_Impl<G> FS;
+	typedef typename FS::fs_block fs_block;
+	const int B = G::BLOCK_SIZE;
+
+	// Leiaute: mesma tabela de inodos que fs_format produz
+	int nblocks = disk->size();
+	int ninodeblocks = std::ceil(nblocks * 0.1);
+	int ninodes = ninodeblocks * G::INODES_PER_BLOCK;
+
+	// Só os blocos da tabela com inodos são montados e escritos: a imagem é nova
+	// e esparsa, e o resto da tabela já é lido como zeros
+	std::vector<fs_block> table(std::min<std::size_t>(ninodeblocks, (files.size() + 1) / G::INODES_PER_BLOCK + 1));
+	memset(table.data(), 0, table.size() * sizeof(fs_block));
+
+	int next = 1 + ninodeblocks;
+	int data_start = next;
+	bytes = 0;
+	for (std::size_t i = 0; i < files.size(); i++)
+	{
+		host_file &f = files[i];
+		f.nblocks = (f.size + B - 1) / B;
+		if (f.nblocks > G::POINTERS_PER_INODE + G::POINTERS_PER_BLOCK)
+		{
+			cout << "ERROR: " << f.host_path << " is too large for " << B << "-byte blocks\n";
+			return 0;
+		}
+		// O inodo 1 fica para o diretório raiz
+		f.inumber = i + 2;
+		if (f.inumber >= ninodes)
+		{
+			cout << "ERROR: not enough inodes for " << files.size() << " files\n";
+			return 0;
+		}
+		f.indirect = f.nblocks > G::POINTERS_PER_INODE ? next++ : 0;
+		f.first = next;
+		next += f.nblocks;
+		bytes += f.size;
+
+		typename FS::fs_inode &inode = table[f.inumber / G::INODES_PER_BLOCK].inode[f.inumber % G::INODES_PER_BLOCK];
+		inode.isvalid = 1;
+		inode.size = f.size;
+		for (int k = 0; k < G::POINTERS_PER_INODE && k < f.nblocks; k++)
+		{
+			inode.direct[k] = f.first + k;
+		}
+		inode.indirect = f.indirect;
+	}
+	if (next > nblocks)
+	{
+		cout << "ERROR: the files need at least " << next << " blocks\n";
+		return 0;
+	}
+
+	fs_block super;
+	memset(super.data, 0, B);
+	super.super.magic = INE5412_FS::FS_MAGIC;
+	super.super.nblocks = nblocks;
+	super.super.ninodeblocks = ninodeblocks;
+	super.super.ninodes = ninodes;
+	super.super.block_size = B;
+	super.super.group_blocks = 0;
+	super.super.pointer_bytes = sizeof(int);
+	disk->write(0, super.data, Disk::IO_SUPER);
+	disk->write_blocks(1, table.size(), table[0].data, Disk::IO_INODE);
+
+	// Cada thread pega o próximo lote ainda não escrito
+	int batch_blocks = std::max(1, BATCH_BYTES / B);
+	int nbatches = (next - data_start + batch_blocks - 1) / batch_blocks;
+	std::atomic<int> next_batch(0);
+	std::atomic<bool> failed(false);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < nthreads; t++)
+	{
+		workers.push_back(std::thread([&] {
+			std::vector<char> buf((std::size_t)batch_blocks * B);
+			for (int b = next_batch++; b < nbatches && !failed; b = next_batch++)
+			{
+				int start = data_start + b * batch_blocks;
+				int count = std::min(batch_blocks, next - start);
+				std::fill(buf.begin(), buf.begin() + (std::size_t)count * B, 0);
+				if (!fill_batch<G>(files, start, count, buf.data()))
+				{
+					failed = true;
+					break;
+				}
+				disk->write_blocks(start, count, buf.data());
+			}
+		}));
+	}
+	for (std::size_t t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+	return !failed;
+}
+
+// Cria os diretórios e liga cada arquivo ao seu nome.
+static int link_names(INE5412_FS *fs, const std::vector<std::string> &dirs, const std::vector<host_file> &files)
+{
+	if (!fs->fs_mount())
+		return 0;
+
+	FS_Dir dir(fs);
+	if (!dir.mkroot())
+		return 0;
+
+	// Os diretórios vêm antes dos seus filhos, na ordem da varredura
+	std::map<std::string, int> inumbers;
+	inumbers[""] = FS_Dir::ROOT_INUMBER;
+	for (std::size_t i = 0; i < dirs.size(); i++)
+	{
+		std::size_t slash = dirs[i].find_last_of('/');
+		int inumber = dir.mkdir(inumbers[dirs[i].substr(0, slash)], dirs[i].c_str() + slash + 1);
+		if (!inumber)
+			return 0;
+		inumbers[dirs[i]] = inumber;
+	}
+	for (std::size_t i = 0; i < files.size(); i++)
+	{
+		std::size_t slash = files[i].path.find_last_of('/');
+		if (!dir.link(inumbers[files[i].path.substr(0, slash)], files[i].path.c_str() + slash + 1, files[i].inumber))
+			return 0;
+	}
+	return fs->fs_sync();
+}
+
+int main(int argc, char *argv[])
+{
+	int block_size = Disk::DISK_BLOCK_SIZE;
+	int nthreads = std::max(1u, std::thread::hardware_concurrency());
+	int opt;
+	while ((opt = getopt(argc, argv, "b:j:")) != -1)
+	{
+		if (opt == 'b')
+		{
+			block_size = atoi(optarg);
+		}
+		else if (opt == 'j')
+		{
+			nthreads = std::max(1, atoi(optarg));
+		}
+		else
+		{
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (argc - optind != 3)
+	{
+		cout << "use: " << argv[0] << " [-b <blocksize>] [-j <threads>] <hostdir> <diskfile> <nblocks>\n";
+		return 1;
+	}
+	const char *hostdir = argv[optind];
+	const char *filename = argv[optind + 1];
+	int nblocks = atoi(argv[optind + 2]);
+
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::string> dirs;
+	std::vector<host_file> files;
+	if (!scan(hostdir, "", dirs, files))
+		return 1;
+
+	// Começa de uma imagem vazia (e esparsa)
+	unlink(filename);
+	Disk *disk = new Disk(filename, nblocks, block_size);
+
+	long bytes = 0;
+	int ok;
+	switch (block_size)
+	{
+	case 4096:
+		ok = build<fs_geometry<4096>>(disk, files, bytes, nthreads);
+		break;
+	case 16384:
+		ok = build<fs_geometry<16384>>(disk, files, bytes, nthreads);
+		break;
+	case 65536:
+		ok = build<fs_geometry<65536>>(disk, files, bytes, nthreads);
+		break;
+	default:
+		cout << "ERROR: tamanho de bloco " << block_size << " não suportado\n";
+		ok = 0;
+	}
+
+	std::chrono::duration<double> data_time = std::chrono::steady_clock::now() - begin;
+
+	INE5412_FS *fs = ok ? INE5412_FS::create(disk) : 0;
+	ok = fs && link_names(fs, dirs, files);
+	delete fs;
+	disk->close();
+	delete disk;
+
+	if (!ok)
+	{
+		cout << "mkimage failed!\n";
+		return 1;
+	}
+
+	std::chrono::duration<double> total_time = std::chrono::steady_clock::now() - begin;
+	double mb = bytes / (1024.0 * 1024.0);
+	printf("%zu files, %zu directories, %.1f MB written with %d threads\n", files.size(), dirs.size(), mb, nthreads);
+	printf("data: %.3f s, %.0f files/s, %.1f MB/s\n", data_time.count(), files.size() / data_time.count(), mb / data_time.count());
+	printf("total (with directories): %.3f s, %.0f files/s\n", total_time.count(), files.size() / total_time.count());
+	return 0;
+}
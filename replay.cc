@@ -0,0 +1,248 @@
+#include "disk.h"
+#include "striped_disk.h"
+#include "direct_disk.h"
+#include "elevator_disk.h"
+
+#include <chrono>
+#include <list>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
+
+// Reexecuta um trace gravado por Disk::trace_open contra um disco qualquer.
+// As requisições são repetidas na ordem do trace, com os mesmos blocos e
+// tamanhos, de modo que backends e tamanhos de cache diferentes podem ser
+// comparados sobre exatamente o mesmo padrão de acesso.
+// Atenção: as escritas do trace sobrescrevem o conteúdo das imagens.
+
+// Cache LRU de blocos simulado na frente do disco.
+// As escritas passam direto para o disco e deixam o bloco no cache.
+class block_cache
+{
+public:
+	block_cache(int capacity)
+	{
+		this->capacity = capacity;
+	}
+
+	// Retorna true se o bloco estava no cache; em ambos os casos ele passa
+	// a ser o mais recentemente usado
+	bool access(int block)
+	{
+		if (capacity == 0)
+			return false;
+
+		std::unordered_map<int, std::list<int>::iterator>::iterator it = where.find(block);
+		if (it != where.end())
+		{
+			lru.splice(lru.begin(), lru, it->second);
+			return true;
+		}
+
+		if ((int)lru.size() == capacity)
+		{
+			where.erase(lru.back());
+			lru.pop_back();
+		}
+		lru.push_front(block);
+		where[block] = lru.begin();
+		return false;
+	}
+
+private:
+	int capacity;
+	std::list<int> lru;
+	std::unordered_map<int, std::list<int>::iterator> where;
+};
+
+static const char *context_names[] = {"superblock", "inode", "indirect", "data"};
+
+int main(int argc, char *argv[])
+{
+	int stripe = Striped_Disk::DEFAULT_STRIPE;
+	int cache_blocks = 0;
+	bool realtime = false;
+	const Disk::service_model *model = 0;
+	bool direct = false;
+	int queue_depth = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:c:rm:dq:")) != -1)
+	{
+		if (opt == 's')
+		{
+			stripe = atoi(optarg);
+		}
+		else if (opt == 'c')
+		{
+			cache_blocks = atoi(optarg);
+		}
+		else if (opt == 'r')
+		{
+			realtime = true;
+		}
+		else if (opt == 'm' && Disk::find_model(optarg))
+		{
+			model = Disk::find_model(optarg);
+		}
+		else if (opt == 'd')
+		{
+			direct = true;
+		}
+		else if (opt == 'q')
+		{
+			queue_depth = atoi(optarg);
+		}
+		else
+		{
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (argc - optind < 2)
+	{
+		cout << "use: " << argv[0] << " [-s <stripeblocks>] [-c <cacheblocks>] [-r] [-m hdd|ssd] [-d] [-q <queueblocks>] <tracefile> <diskfile> [<diskfile> ...]\n";
+		cout << "    -c simulates an LRU block cache; -r keeps the recorded request times;\n";
+		cout << "    -m charges each request with the modeled service time of a disk or SSD;\n";
+		cout << "    -d opens a single image with O_DIRECT;\n";
+		cout << "    -q puts an elevator queue of that many blocks in front of the disk\n";
+		return 1;
+	}
+
+	FILE *file = fopen(argv[optind], "r");
+	Disk::trace_header header;
+	if (!file || fread(&header, sizeof(header), 1, file) != 1 || header.magic != Disk::TRACE_MAGIC)
+	{
+		cout << "ERROR: " << argv[optind] << " is not a trace file\n";
+		if (file)
+			fclose(file);
+		return 1;
+	}
+
+	// O disco tem a mesma geometria do disco em que o trace foi gravado
+	vector<string> images(argv + optind + 1, argv + argc);
+	Disk *disk;
+	if (images.size() == 1 && direct)
+	{
+		disk = new Direct_Disk(images[0].c_str(), header.nblocks, header.block_size);
+	}
+	else if (images.size() == 1)
+	{
+		disk = new Disk(images[0].c_str(), header.nblocks, header.block_size);
+	}
+	else
+	{
+		disk = new Striped_Disk(images, header.nblocks, stripe, header.block_size);
+	}
+
+	if (model)
+	{
+		disk->set_model(*model);
+	}
+	if (queue_depth > 0)
+	{
+		disk = new Elevator_Disk(disk, queue_depth);
+	}
+
+	block_cache cache(cache_blocks);
+	// Alinhado, para que um Direct_Disk não precise copiar
+	char *buffer = 0;
+	std::size_t capacity = 0;
+	long requests[2][4] = {{0}};
+	long blocks[2][4] = {{0}};
+	long hits = 0, misses = 0;
+	double busy = 0, slowest = 0;
+
+	Disk::trace_record record;
+	auto start = std::chrono::steady_clock::now();
+	while (fread(&record, sizeof(record), 1, file) == 1)
+	{
+		if (record.op > Disk::OP_WRITE || record.context > Disk::IO_DATA || (long)record.block + record.count > (long)header.nblocks)
+		{
+			cout << "ERROR: invalid trace record\n";
+			break;
+		}
+
+		if (realtime)
+		{
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.time));
+		}
+
+		requests[record.op][record.context]++;
+		blocks[record.op][record.context] += record.count;
+		if (capacity < (std::size_t)record.count * header.block_size)
+		{
+			free(buffer);
+			capacity = (std::size_t)record.count * header.block_size;
+			if (posix_memalign((void **)&buffer, Disk::BUFFER_ALIGN, capacity) != 0)
+			{
+				cout << "ERROR: couldn't allocate the replay buffer\n";
+				return 1;
+			}
+			memset(buffer, 0, capacity);
+		}
+
+		auto issued = std::chrono::steady_clock::now();
+		if (record.op == Disk::OP_WRITE)
+		{
+			for (int i = 0; i < record.count; i++)
+			{
+				cache.access(record.block + i);
+			}
+			disk->write_blocks(record.block, record.count, buffer, record.context);
+		}
+		else
+		{
+			// Só as sequências de blocos fora do cache vão para o disco
+			int i = 0;
+			while (i < record.count)
+			{
+				if (cache.access(record.block + i))
+				{
+					hits++;
+					i++;
+					continue;
+				}
+				int first = i++;
+				misses++;
+				while (i < record.count && !cache.access(record.block + i))
+				{
+					misses++;
+					i++;
+				}
+				disk->read_blocks(record.block + first, i - first, buffer, record.context);
+			}
+		}
+		std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - issued;
+		busy += latency.count();
+		slowest = std::max(slowest, latency.count());
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	fclose(file);
+	free(buffer);
+
+	long total_requests = 0, total_blocks = 0;
+	cout << "              read reqs  read blocks  write reqs  write blocks\n";
+	for (int c = Disk::IO_SUPER; c <= Disk::IO_DATA; c++)
+	{
+		printf("  %-10s  %9ld  %11ld  %10ld  %12ld\n", context_names[c], requests[Disk::OP_READ][c], blocks[Disk::OP_READ][c],
+			   requests[Disk::OP_WRITE][c], blocks[Disk::OP_WRITE][c]);
+		total_requests += requests[Disk::OP_READ][c] + requests[Disk::OP_WRITE][c];
+		total_blocks += blocks[Disk::OP_READ][c] + blocks[Disk::OP_WRITE][c];
+	}
+	if (cache_blocks > 0)
+	{
+		printf("cache of %d blocks: %ld hits, %ld misses (%.1f%% hit rate)\n", cache_blocks, hits, misses,
+			   hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+	}
+	double mb = (double)total_blocks * header.block_size / (1024.0 * 1024.0);
+	printf("%ld requests in %.3f s: %.0f requests/s, %.1f MB/s, %.2f us average, %.2f us slowest\n", total_requests,
+		   elapsed.count(), total_requests / elapsed.count(), mb / elapsed.count(),
+		   total_requests ? busy / total_requests : 0.0, slowest);
+
+	disk->close();
+	delete disk;
+	return 0;
+}
@@ -1,9 +1,17 @@
 #include "fs.h"
+#include "fs_async.h"
+#include "fs_dir.h"
 #include "disk.h"
+#include "striped_disk.h"
+#include "direct_disk.h"
+#include "elevator_disk.h"
 
+#include <algorithm>
+#include <chrono>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 class File_Ops
 {
@@ -12,6 +20,16 @@ public:
 
     static int do_copyout(int inumber, const char *filename, INE5412_FS *fs);
 
+    // Aceita um inúmero ou um caminho absoluto ("/dir/arquivo")
+    static int to_inumber(const char *arg, FS_Dir *dir);
+    // Como to_inumber, mas recusa diretórios, que só a camada de diretórios escreve
+    static int to_file(const char *arg, FS_Dir *dir);
+    // Cria um inodo vazio e o liga ao caminho
+    static int do_create(const char *path, FS_Dir *dir, INE5412_FS *fs);
+    // Mede o tempo de lookup em diretórios de tamanhos crescentes
+    static void do_dirbench(int nentries, FS_Dir *dir, INE5412_FS *fs);
+    // Compara fs_read/fs_write em sequência com as mesmas requisições via FS_Async
+    static void do_asyncbench(int nfiles, int kbytes, int nworkers, INE5412_FS *fs);
 };
 
 using namespace std;
@@ -22,19 +40,94 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
 	int inumber, result, args;
 
-	if(argc != 3) {
-		cout << "use: " << argv[0] << " <diskfile> <nblocks>\n";
+	int stripe = Striped_Disk::DEFAULT_STRIPE;
+	int block_size = 0;
+	const char *tracefile = 0;
+	const Disk::service_model *model = 0;
+	bool direct = false;
+	int queue_depth = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "s:b:t:m:dq:")) != -1) {
+		if(opt == 's') {
+			stripe = atoi(optarg);
+		} else if(opt == 'b') {
+			block_size = atoi(optarg);
+		} else if(opt == 't') {
+			tracefile = optarg;
+		} else if(opt == 'm' && Disk::find_model(optarg)) {
+			model = Disk::find_model(optarg);
+		} else if(opt == 'd') {
+			direct = true;
+		} else if(opt == 'q') {
+			queue_depth = atoi(optarg);
+		} else {
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if(argc - optind < 2) {
+		cout << "use: " << argv[0] << " [-s <stripeblocks>] [-b <blocksize>] [-t <tracefile>] [-m hdd|ssd] [-d] [-q <queueblocks>] <diskfile> [<diskfile> ...] <nblocks>\n";
 		return 1;
 	}
 
+	// Com mais de uma imagem, os blocos são distribuídos entre elas
+	vector<string> images(argv + optind, argv + argc - 1);
+	int nblocks = atoi(argv[argc - 1]);
+	// Sem -b, usa o tamanho de bloco registrado na imagem, se houver. Um -b
+	// diferente é recusado antes que o Disk redimensione (e destrua) a imagem
+	int probed = INE5412_FS::probe_block_size(images[0].c_str());
+	if(block_size && probed && block_size != probed) {
+		cout << "ERROR: " << images[0] << " is formatted with " << probed << "-byte blocks, not " << block_size << "\n";
+		return 1;
+	}
+	if(!block_size) {
+		block_size = probed;
+	}
+	if(!block_size) {
+		block_size = Disk::DISK_BLOCK_SIZE;
+	}
+	Disk *disk;
+	if(images.size() == 1 && direct) {
+		disk = new Direct_Disk(images[0].c_str(), nblocks, block_size);
+	} else if(images.size() == 1) {
+		disk = new Disk(images[0].c_str(), nblocks, block_size);
+	} else {
+		disk = new Striped_Disk(images, nblocks, stripe, block_size);
+	}
 
-    Disk disk(argv[1], atoi(argv[2]));
+	if(model) {
+		disk->set_model(*model);
+	}
+
+	// O modelo fica no backend, que recebe as requisições já ordenadas e reunidas
+	if(queue_depth > 0) {
+		disk = new Elevator_Disk(disk, queue_depth);
+	}
 
-    INE5412_FS fs(&disk);
+	// Registra todas as requisições ao disco para simplefs-replay
+	if(tracefile && !disk->trace_open(tracefile)) {
+		disk->close();
+		delete disk;
+		return 1;
+	}
 
-	cout << "opened emulated disk image " << argv[1] << " with " << disk.size() << " blocks\n";
+	INE5412_FS *fs = INE5412_FS::create(disk);
+	if(!fs) {
+		disk->close();
+		delete disk;
+		return 1;
+	}
+	FS_Dir dir(fs);
+
+	if(images.size() == 1) {
+		cout << "opened emulated disk image " << images[0] << " with " << disk->size() << " blocks\n";
+	} else {
+		cout << "opened emulated disk striped over " << images.size() << " images (" << stripe << " blocks per stripe) with " << disk->size() << " blocks\n";
+	}
 
 	while(1) {
 		cout << " simplefs> ";
@@ -48,24 +141,31 @@ int main( int argc, char *argv[] )
 
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s", cmd, arg1, arg2);
+		args = sscanf(line,"%s %s %s %s", cmd, arg1, arg2, arg3);
 
 		if(args == 0) 
             continue;
 
 		if(!strcmp(cmd, "format")) {
-			if(args == 1) {
-				if(fs.fs_format()) {
+			// "lazy" no fim pede a formatação rápida; "log", o modo estruturado em log
+			const char *last = args == 2 ? arg1 : arg2;
+			bool lazy = args > 1 && !strcmp(last, "lazy");
+			bool log = args == 2 && !strcmp(last, "log");
+			int group_blocks = args - lazy == 2 && !log ? atoi(arg1) : 0;
+			if(args <= 2 || (args == 3 && lazy)) {
+				int ok = log ? fs->fs_format_log() : lazy ? fs->fs_format_lazy(group_blocks) : fs->fs_format_groups(group_blocks);
+				if(ok) {
 					cout << "disk formatted.\n";
 				} else {
 					cout << "format failed!\n";
 				}
 			} else {
-				cout << "use: format\n";
+				cout << "use: format [<groupblocks>] [lazy|log]\n";
 			}
 		} else if(!strcmp(cmd, "mount")) {
 			if(args == 1) {
-				if(fs.fs_mount()) {
+				if(fs->fs_mount()) {
+					dir.reset();
 					cout << "disk mounted.\n";
 				} else {
 					cout << "mount failed!\n";
@@ -75,89 +175,276 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd, "debug")) {
 			if(args == 1) {
-				fs.fs_debug();
+				fs->fs_debug();
 			} else {
 				cout << "use: debug\n";
 			}
 		} else if(!strcmp(cmd, "getsize")) {
 			if(args == 2) {
-				inumber = atoi(arg1);
-				result = fs.fs_getsize(inumber);
+				inumber = File_Ops::to_inumber(arg1, &dir);
+				result = fs->fs_getsize(inumber);
 				if(result >= 0) {
 					cout << "inode " << inumber << " has size " << result << "\n";
 				} else {
 					cout << "getsize failed!\n";
 				}
 			} else {
-				cout << "use: getsize <inumber>\n";
+				cout << "use: getsize <inumber|path>\n";
 			}
 			
 		} else if(!strcmp(cmd, "create")) {
-			if(args == 1) {
-				inumber = fs.fs_create();
+			if(args == 1 || args == 2) {
+				inumber = args == 1 ? fs->fs_create() : File_Ops::do_create(arg1, &dir, fs);
 				if(inumber > 0) {
 					cout << "created inode " << inumber << "\n";
 				} else {
 					cout << "create failed!\n";
 				}
 			} else {
-				cout << "use: create\n";
+				cout << "use: create [<path>]\n";
 			}
 		} else if(!strcmp(cmd, "delete")) {
 			if(args == 2) {
-				inumber = atoi(arg1);
-				if(fs.fs_delete(inumber)) {
+				inumber = File_Ops::to_inumber(arg1, &dir);
+				// Um caminho só perde o nome; o inodo é liberado com o último deles
+				if(arg1[0] == '/' && inumber) {
+					string name;
+					int parent = dir.resolve_parent(arg1, name);
+					if(!parent || !dir.unlink(parent, name.c_str())) {
+						cout << "delete failed!\n";
+					} else if(dir.nlink(inumber)) {
+						cout << arg1 << " unlinked, inode " << inumber << " still has " << dir.nlink(inumber) << " name(s).\n";
+					} else {
+						cout << "inode " << inumber << " deleted.\n";
+					}
+				} else if(inumber && dir.nlink(inumber)) {
+					cout << "ERROR: inode " << inumber << " still has " << dir.nlink(inumber) << " name(s); use unlink\n";
+					cout << "delete failed!\n";
+				} else if(inumber && fs->fs_delete(inumber)) {
 					cout << "inode " << inumber << " deleted.\n";
 				} else {
 					cout << "delete failed!\n";	
 				}
 			} else {
-				cout << "use: delete <inumber>\n";
+				cout << "use: delete <inumber|path>\n";
 			}
 		} else if(!strcmp(cmd, "cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
-				if(!File_Ops::do_copyout(inumber, "/dev/stdout", &fs)) {
+				inumber = File_Ops::to_inumber(arg1, &dir);
+				if(!File_Ops::do_copyout(inumber, "/dev/stdout", fs)) {
 					cout << "cat failed!\n";
 				}
 			} else {
-				cout << "use: cat <inumber>\n";
+				cout << "use: cat <inumber|path>\n";
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
-				if(File_Ops::do_copyin(arg1, inumber, &fs)) {
+				inumber = arg2[0] == '/' ? dir.resolve(arg2) : atoi(arg2);
+				if(arg2[0] == '/' && !inumber) {
+					inumber = File_Ops::do_create(arg2, &dir, fs);
+				} else {
+					inumber = File_Ops::to_file(arg2, &dir);
+				}
+				if(inumber && File_Ops::do_copyin(arg1, inumber, fs)) {
 					cout << "copied file " << arg1 << " to inode " << inumber << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyin <filename> <inumber>\n";
+				cout << "use: copyin <filename> <inumber|path>\n";
 			}
 
 		} else if(!strcmp(cmd, "copyout")) {
 			if(args == 3) {
-				inumber = atoi(arg1);
-				if(File_Ops::do_copyout(inumber, arg2, &fs)) {
+				inumber = File_Ops::to_inumber(arg1, &dir);
+				if(File_Ops::do_copyout(inumber, arg2, fs)) {
 					cout << "copied inode " << inumber << " to file " << arg2 << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyout <inumber> <filename>\n";
+				cout << "use: copyout <inumber|path> <filename>\n";
+			}
+
+		} else if(!strcmp(cmd, "truncate")) {
+			if(args == 3) {
+				inumber = File_Ops::to_file(arg1, &dir);
+				if(inumber && fs->fs_truncate(inumber, atoi(arg2))) {
+					cout << "inode " << inumber << " truncated to " << arg2 << " bytes.\n";
+				} else {
+					cout << "truncate failed!\n";
+				}
+			} else {
+				cout << "use: truncate <inumber|path> <size>\n";
+			}
+
+		} else if(!strcmp(cmd, "fallocate")) {
+			if(args == 4) {
+				inumber = File_Ops::to_file(arg1, &dir);
+				if(inumber && fs->fs_fallocate(inumber, atoi(arg2), atoi(arg3))) {
+					cout << "reserved " << arg3 << " bytes at offset " << arg2 << " in inode " << inumber << "\n";
+				} else {
+					cout << "fallocate failed!\n";
+				}
+			} else {
+				cout << "use: fallocate <inumber|path> <offset> <length>\n";
+			}
+
+		} else if(!strcmp(cmd, "clone")) {
+			if(args == 2) {
+				inumber = File_Ops::to_inumber(arg1, &dir);
+				result = fs->fs_clone(inumber);
+				if(result > 0) {
+					cout << "cloned inode " << inumber << " to inode " << result << "\n";
+				} else {
+					cout << "clone failed!\n";
+				}
+			} else {
+				cout << "use: clone <inumber|path>\n";
+			}
+
+		} else if(!strcmp(cmd, "snapshot")) {
+			if(args == 1) {
+				result = fs->fs_snapshot();
+				if(result > 0) {
+					// O manifesto guarda pares (inodo original, clone)
+					int pair[2];
+					cout << "snapshot manifest in inode " << result << "\n";
+					for(int offset = 0; fs->fs_read(result, (char *)pair, sizeof(pair), offset) == sizeof(pair); offset += sizeof(pair)) {
+						cout << "    inode " << pair[0] << " -> " << pair[1] << "\n";
+					}
+				} else {
+					cout << "snapshot failed!\n";
+				}
+			} else {
+				cout << "use: snapshot\n";
+			}
+
+		} else if(!strcmp(cmd, "delalloc")) {
+			if(args == 2 && (!strcmp(arg1, "on") || !strcmp(arg1, "off"))) {
+				fs->fs_set_delalloc(!strcmp(arg1, "on"));
+				cout << "delayed allocation " << arg1 << ".\n";
+			} else {
+				cout << "use: delalloc on|off\n";
+			}
+
+		} else if(!strcmp(cmd, "sync")) {
+			if(args == 1) {
+				if(fs->fs_sync()) {
+					cout << "disk synced.\n";
+				} else {
+					cout << "sync failed!\n";
+				}
+			} else {
+				cout << "use: sync\n";
+			}
+
+		} else if(!strcmp(cmd, "mkroot")) {
+			if(args == 1) {
+				if(dir.mkroot()) {
+					cout << "root directory created.\n";
+				} else {
+					cout << "mkroot failed!\n";
+				}
+			} else {
+				cout << "use: mkroot\n";
+			}
+
+		} else if(!strcmp(cmd, "mkdir")) {
+			if(args == 2) {
+				string name;
+				int parent = dir.resolve_parent(arg1, name);
+				inumber = parent ? dir.mkdir(parent, name.c_str()) : 0;
+				if(inumber > 0) {
+					cout << "created directory " << arg1 << " in inode " << inumber << "\n";
+				} else {
+					cout << "mkdir failed!\n";
+				}
+			} else {
+				cout << "use: mkdir <path>\n";
+			}
+
+		} else if(!strcmp(cmd, "ls")) {
+			if(args == 1 || args == 2) {
+				vector<FS_Dir::fs_dirent> entries;
+				inumber = args == 1 ? FS_Dir::ROOT_INUMBER : File_Ops::to_inumber(arg1, &dir);
+				if(inumber && dir.readdir(inumber, entries) >= 0) {
+					sort(entries.begin(), entries.end(), [](const FS_Dir::fs_dirent &a, const FS_Dir::fs_dirent &b) { return strcmp(a.name, b.name) < 0; });
+					for(size_t i = 0; i < entries.size(); i++) {
+						cout << "    " << entries[i].inumber << "\t" << entries[i].name << (dir.is_dir(entries[i].inumber) ? "/" : "") << "\n";
+					}
+				} else {
+					cout << "ls failed!\n";
+				}
+			} else {
+				cout << "use: ls [<path>]\n";
+			}
+
+		} else if(!strcmp(cmd, "ln")) {
+			if(args == 3) {
+				string name;
+				inumber = File_Ops::to_inumber(arg1, &dir);
+				int parent = dir.resolve_parent(arg2, name);
+				if(inumber && parent && dir.link(parent, name.c_str(), inumber)) {
+					cout << "linked inode " << inumber << " as " << arg2 << "\n";
+				} else {
+					cout << "ln failed!\n";
+				}
+			} else {
+				cout << "use: ln <inumber|path> <path>\n";
+			}
+
+		} else if(!strcmp(cmd, "unlink")) {
+			if(args == 2) {
+				string name;
+				int parent = dir.resolve_parent(arg1, name);
+				if(parent && dir.unlink(parent, name.c_str())) {
+					cout << arg1 << " unlinked.\n";
+				} else {
+					cout << "unlink failed!\n";
+				}
+			} else {
+				cout << "use: unlink <path>\n";
+			}
+
+		} else if(!strcmp(cmd, "dirbench")) {
+			if(args == 2 && atoi(arg1) > 0) {
+				File_Ops::do_dirbench(atoi(arg1), &dir, fs);
+			} else {
+				cout << "use: dirbench <nentries>\n";
+			}
+
+		} else if(!strcmp(cmd, "asyncbench")) {
+			if((args == 3 || args == 4) && atoi(arg1) > 0 && atoi(arg2) > 0 && (args == 3 || atoi(arg3) > 0)) {
+				File_Ops::do_asyncbench(atoi(arg1), atoi(arg2), args == 4 ? atoi(arg3) : 4, fs);
+			} else {
+				cout << "use: asyncbench <nfiles> <kbytes> [<workers>]\n";
 			}
 
 		} else if(!strcmp(cmd, "help")) {
 			cout << "Commands are:\n";
-			cout << "    format\n";
+			cout << "    format  [<groupblocks>] [lazy|log]\n";
 			cout << "    mount\n";
 			cout << "    debug\n";
-			cout << "    create\n";
-			cout << "    delete  <inode>\n";
-			cout << "    cat     <inode>\n";
-			cout << "    copyin  <file> <inode>\n";
-			cout << "    copyout <inode> <file>\n";
+			cout << "    create  [<path>]\n";
+			cout << "    delete  <inode|path>\n";
+			cout << "    cat     <inode|path>\n";
+			cout << "    copyin  <file> <inode|path>\n";
+			cout << "    copyout <inode|path> <file>\n";
+			cout << "    truncate  <inode|path> <size>\n";
+			cout << "    fallocate <inode|path> <offset> <length>\n";
+			cout << "    clone     <inode|path>\n";
+			cout << "    snapshot\n";
+			cout << "    delalloc  on|off\n";
+			cout << "    sync\n";
+			cout << "    mkroot\n";
+			cout << "    mkdir   <path>\n";
+			cout << "    ls      [<path>]\n";
+			cout << "    ln      <inode|path> <path>\n";
+			cout << "    unlink  <path>\n";
+			cout << "    dirbench <nentries>\n";
+			cout << "    asyncbench <nfiles> <kbytes> [<workers>]\n";
 			cout << "    help\n";
 			cout << "    quit\n";
 			cout << "    exit\n";
@@ -172,8 +459,13 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	fs->fs_sync();
+
 	cout << "closing emulated disk.\n";
-	disk.close();
+	// As threads do sistema de arquivos param antes de o disco fechar
+	delete fs;
+	disk->close();
+	delete disk;
 
 	return 0;
 }
@@ -182,7 +474,8 @@ int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 {
 	FILE *file;
 	int offset=0, result, actual;
-	char buffer[16384];
+	// Alinhado, para que o Direct_Disk leia e escreva direto nele
+	alignas(Disk::BUFFER_ALIGN) char buffer[16384];
 
 	file = fopen(filename, "r");
 	if(!file) {
@@ -218,7 +511,8 @@ int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 {
 	FILE *file;
 	int offset = 0, result;
-	char buffer[16384];
+	// Alinhado, para que o Direct_Disk leia e escreva direto nele
+	alignas(Disk::BUFFER_ALIGN) char buffer[16384];
 
 	file = fopen(filename,"w");
 	if(!file) {
@@ -239,3 +533,171 @@ int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 	return 1;
 }
 
+
+int File_Ops::to_inumber(const char *arg, FS_Dir *dir)
+{
+	if(arg[0] != '/') {
+		return atoi(arg);
+	}
+
+	int inumber = dir->resolve(arg);
+	if(!inumber) {
+		cout << "no such file or directory: " << arg << "\n";
+	}
+	return inumber;
+}
+
+int File_Ops::to_file(const char *arg, FS_Dir *dir)
+{
+	int inumber = to_inumber(arg, dir);
+	if(inumber && dir->is_dir(inumber)) {
+		cout << "ERROR: " << arg << " is a directory\n";
+		return 0;
+	}
+	return inumber;
+}
+
+int File_Ops::do_create(const char *path, FS_Dir *dir, INE5412_FS *fs)
+{
+	string name;
+	int parent = dir->resolve_parent(path, name);
+	if(!parent) {
+		cout << "no such directory for " << path << "\n";
+		return 0;
+	}
+
+	int inumber = fs->fs_create();
+	if(inumber && !dir->link(parent, name.c_str(), inumber)) {
+		fs->fs_delete(inumber);
+		inumber = 0;
+	}
+	return inumber;
+}
+
+void File_Ops::do_dirbench(int nentries, FS_Dir *dir, INE5412_FS *fs)
+{
+	const char *name = ".dirbench";
+	int bench = dir->mkdir(FS_Dir::ROOT_INUMBER, name);
+	int target = bench ? fs->fs_create() : 0;
+	if(!target) {
+		cout << "dirbench failed!\n";
+		if(bench) {
+			dir->unlink(FS_Dir::ROOT_INUMBER, name);
+		}
+		return;
+	}
+
+	// Todas as entradas apontam para o mesmo inodo vazio
+	cout << "    entries  buckets  cold us/lookup  cached us/lookup\n";
+	int linked = 0;
+	char entry[32];
+	for(int size = 16; linked < nentries; size *= 4) {
+		size = min(size, nentries);
+		for(; linked < size; linked++) {
+			snprintf(entry, sizeof(entry), "f%d", linked);
+			if(!dir->link(bench, entry, target)) {
+				break;
+			}
+		}
+		if(linked < size) {
+			break;
+		}
+
+		// Procura nomes espalhados pelo diretório: primeiro com o dentry
+		// cache vazio, depois com os mesmos nomes já em cache
+		int samples = min(linked, 1000);
+		double us[2];
+		dir->dcache_drop();
+		for(int pass = 0; pass < 2; pass++) {
+			auto start = chrono::steady_clock::now();
+			for(int i = 0; i < samples; i++) {
+				snprintf(entry, sizeof(entry), "f%d", (int)((long)i * linked / samples));
+				dir->lookup(bench, entry);
+			}
+			chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+			us[pass] = elapsed.count() / samples;
+		}
+		printf("    %7d  %7d  %14.2f  %16.2f\n", linked, dir->buckets(bench), us[0], us[1]);
+	}
+
+	// O último unlink de cada nome libera o inodo
+	for(int i = 0; i < linked; i++) {
+		snprintf(entry, sizeof(entry), "f%d", i);
+		dir->unlink(bench, entry);
+	}
+	if(!linked) {
+		fs->fs_delete(target);
+	}
+	dir->unlink(FS_Dir::ROOT_INUMBER, name);
+}
+
+void File_Ops::do_asyncbench(int nfiles, int kbytes, int nworkers, INE5412_FS *fs)
+{
+	const int request = 64 * 1024;
+	int length = kbytes * 1024;
+	vector<int> inodes;
+	for(int i = 0; i < nfiles; i++) {
+		int inumber = fs->fs_create();
+		if(!inumber) {
+			break;
+		}
+		inodes.push_back(inumber);
+	}
+
+	vector<char> data(length);
+	for(int i = 0; i < length; i++) {
+		data[i] = 'a' + i % 26;
+	}
+	vector<vector<char>> out(inodes.size(), vector<char>(length));
+
+	// Cada passada lê ou escreve os arquivos inteiros em requisições de
+	// "request" bytes; a assíncrona entrega todas ao FS_Async e espera a fila esvaziar.
+	// As escritas partem de arquivos vazios, para que as duas aloquem os blocos
+	FS_Async async(fs, nworkers);
+	auto pass = [&](bool write, bool use_async) {
+		long bytes = 0;
+		for(size_t f = 0; write && f < inodes.size(); f++) {
+			fs->fs_truncate(inodes[f], 0);
+		}
+		auto start = chrono::steady_clock::now();
+		for(size_t f = 0; f < inodes.size(); f++) {
+			for(int offset = 0; offset < length; offset += request) {
+				int n = min(request, length - offset);
+				if(use_async && write) {
+					async.fs_write_async(inodes[f], data.data() + offset, n, offset);
+				} else if(use_async) {
+					async.fs_read_async(inodes[f], out[f].data() + offset, n, offset);
+				} else {
+					bytes += write ? fs->fs_write(inodes[f], data.data() + offset, n, offset) : fs->fs_read(inodes[f], out[f].data() + offset, n, offset);
+				}
+			}
+		}
+		if(use_async) {
+			async.drain();
+			FS_Async::fs_completion c;
+			while(async.poll(c)) {
+				bytes += c.result;
+			}
+		}
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		printf("    %-6s %-5s  %9.2f%s\n", use_async ? "async" : "sync", write ? "write" : "read", bytes / elapsed.count() / (1 << 20),
+			   bytes == (long)inodes.size() * length ? "" : " (short)");
+		return bytes == (long)inodes.size() * length;
+	};
+
+	cout << "    " << inodes.size() << " files of " << kbytes << " KiB, " << nworkers << " workers\n";
+	cout << "    mode   op         MB/s\n";
+	bool ok = inodes.size() == (size_t)nfiles;
+	ok = ok && pass(true, false) && pass(false, false);
+	ok = ok && pass(true, true) && pass(false, true);
+	for(size_t f = 0; ok && f < inodes.size(); f++) {
+		ok = out[f] == data;
+	}
+	if(!ok) {
+		cout << "asyncbench failed!\n";
+	}
+
+	for(size_t f = 0; f < inodes.size(); f++) {
+		fs->fs_delete(inodes[f]);
+	}
+}
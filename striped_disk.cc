@@ -0,0 +1,241 @@
+#include "striped_disk.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+
+Striped_Disk::Striped_Disk(const std::vector<std::string> &filenames, int n, int s, int b)
+{
+	blocksize = b;
+	stripe = s > 0 ? s : DEFAULT_STRIPE;
+
+	int nmembers = filenames.size();
+	int nstripes = (n + stripe - 1) / stripe;
+
+	for (int m = 0; m < nmembers; m++)
+	{
+		member *mb = new member;
+		mb->filename = filenames[m];
+		mb->nreads = 0;
+		mb->nwrites = 0;
+		mb->nrequests = 0;
+		mb->fd = open(filenames[m].c_str(), O_RDWR | O_CREAT, 0644);
+		members.push_back(mb);
+
+		if (mb->fd < 0)
+		{
+			cout << "Error when opening the file " << filenames[m] << "\n";
+			return;
+		}
+
+		// Faixas m, m + N, m + 2N, ... ficam nesta imagem
+		int member_stripes = (nstripes - m + nmembers - 1) / nmembers;
+		ftruncate(mb->fd, (off_t)member_stripes * stripe * blocksize);
+	}
+
+	// A primeira parte de cada requisição fica com quem a fez, então a
+	// thread só é necessária com mais de uma imagem
+	for (int m = 0; m < nmembers && nmembers > 1; m++)
+	{
+		members[m]->thread = std::thread(&Striped_Disk::worker_loop, this, m);
+	}
+
+	nblocks = n;
+}
+
+Striped_Disk::~Striped_Disk()
+{
+	close();
+	workers_stop();
+	for (std::size_t m = 0; m < members.size(); m++)
+	{
+		delete members[m];
+	}
+}
+
+int Striped_Disk::do_read(int blocknum, int count, char *data)
+{
+	return transfer(false, blocknum, count, data);
+}
+
+int Striped_Disk::do_write(int blocknum, int count, const char *data)
+{
+	// transfer() só escreve a partir de "data" quando is_write é verdadeiro
+	return transfer(true, blocknum, count, const_cast<char *>(data));
+}
+
+// Zera cada faixa envolvida na imagem que a contém.
+int Striped_Disk::do_zero(int blocknum, int count)
+{
+	int nmembers = members.size();
+	for (int b = blocknum; b < blocknum + count;)
+	{
+		int s = b / stripe;
+		int in_stripe = min(stripe - b % stripe, blocknum + count - b);
+		off_t offset = ((off_t)(s / nmembers) * stripe + b % stripe) * blocksize;
+		if (!zero_range(members[s % nmembers]->fd, offset, (off_t)in_stripe * blocksize))
+			return 0;
+		b += in_stripe;
+	}
+	return 1;
+}
+
+// Divide a requisição entre as imagens envolvidas e as atende em paralelo.
+int Striped_Disk::transfer(bool is_write, int blocknum, int count, char *data)
+{
+	int nmembers = members.size();
+	int first_stripe = blocknum / stripe;
+	int last_stripe = (blocknum + count - 1) / stripe;
+	int involved = min(last_stripe - first_stripe + 1, nmembers);
+
+	if (involved == 1)
+	{
+		return transfer_member(is_write, first_stripe % nmembers, blocknum, count, data);
+	}
+
+	std::vector<int> results(involved, 0);
+	int remaining = involved - 1;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		for (int i = 1; i < involved; i++)
+		{
+			job j;
+			j.is_write = is_write;
+			j.blocknum = blocknum;
+			j.count = count;
+			j.data = data;
+			j.result = &results[i];
+			j.remaining = &remaining;
+			member *mb = members[(first_stripe + i) % nmembers];
+			mb->queue.push_back(j);
+			mb->wakeup.notify_one();
+		}
+	}
+	results[0] = transfer_member(is_write, first_stripe % nmembers, blocknum, count, data);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	completed.wait(lock, [&] { return remaining == 0; });
+	int ok = 1;
+	for (int i = 0; i < involved; i++)
+	{
+		ok = ok && results[i];
+	}
+	return ok;
+}
+
+// Thread de E/S da imagem m: atende, em ordem, as partes que transfer() lhe entrega.
+void Striped_Disk::worker_loop(int m)
+{
+	member *mb = members[m];
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		mb->wakeup.wait(lock, [&] { return stopping || !mb->queue.empty(); });
+		if (mb->queue.empty())
+			break;
+
+		job j = mb->queue.front();
+		mb->queue.pop_front();
+
+		lock.unlock();
+		int result = transfer_member(j.is_write, m, j.blocknum, j.count, j.data);
+		lock.lock();
+
+		*j.result = result;
+		(*j.remaining)--;
+		completed.notify_all();
+	}
+}
+
+void Striped_Disk::workers_stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		stopping = true;
+	}
+	for (std::size_t m = 0; m < members.size(); m++)
+	{
+		members[m]->wakeup.notify_all();
+		if (members[m]->thread.joinable())
+			members[m]->thread.join();
+	}
+}
+
+// Transfere a parte da requisição [blocknum, blocknum + count) que pertence à imagem m.
+// As faixas de uma imagem são consecutivas no seu arquivo, então a parte inteira
+// é transferida com preadv/pwritev, com um iovec por faixa.
+int Striped_Disk::transfer_member(bool is_write, int m, int blocknum, int count, char *data)
+{
+	member *mb = members[m];
+	int nmembers = members.size();
+
+	std::vector<struct iovec> iov;
+	off_t start = -1;
+	ssize_t expected = 0;
+	int nblocks_member = 0;
+
+	for (int b = blocknum; b < blocknum + count;)
+	{
+		int s = b / stripe;
+		int in_stripe = min(stripe - b % stripe, blocknum + count - b);
+		if (s % nmembers == m)
+		{
+			off_t offset = ((off_t)(s / nmembers) * stripe + b % stripe) * blocksize;
+			if (start < 0)
+				start = offset;
+
+			struct iovec v;
+			v.iov_base = data + (std::size_t)(b - blocknum) * blocksize;
+			v.iov_len = (std::size_t)in_stripe * blocksize;
+			iov.push_back(v);
+			expected += v.iov_len;
+			nblocks_member += in_stripe;
+		}
+		b += in_stripe;
+	}
+
+	// Envia em lotes de no máximo IOV_MAX vetores
+	off_t offset = start;
+	for (std::size_t i = 0; i < iov.size(); i += IOV_MAX)
+	{
+		int n = min((std::size_t)IOV_MAX, iov.size() - i);
+		ssize_t bytes = 0;
+		for (int k = 0; k < n; k++)
+			bytes += iov[i + k].iov_len;
+
+		ssize_t done = is_write ? pwritev(mb->fd, &iov[i], n, offset) : preadv(mb->fd, &iov[i], n, offset);
+		if (done != bytes)
+			return 0;
+
+		offset += bytes;
+		mb->nrequests++;
+	}
+
+	if (is_write)
+		mb->nwrites += nblocks_member;
+	else
+		mb->nreads += nblocks_member;
+	return 1;
+}
+
+void Striped_Disk::close()
+{
+	trace_close();
+	if (members.empty() || members[0]->fd < 0)
+		return;
+
+	cout << nreads << " disk block reads\n";
+	cout << nwrites << " disk block writes\n";
+	report_stats();
+	for (std::size_t m = 0; m < members.size(); m++)
+	{
+		member *mb = members[m];
+		cout << "    " << mb->filename << ": " << mb->nreads << " block reads, " << mb->nwrites
+			 << " block writes, " << mb->nrequests << " requests\n";
+		if (mb->fd >= 0)
+			::close(mb->fd);
+		mb->fd = -1;
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef STRIPED_DISK_H
+#define STRIPED_DISK_H
+
+#include "disk.h"
+
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <thread>
+
+// Disco distribuído (estilo RAID-0) sobre várias imagens.
+// Os blocos lógicos são agrupados em faixas de "stripe" blocos, atribuídas
+// às imagens em rodízio: a faixa s fica na imagem s % N, na posição s / N.
+// Uma requisição que envolve várias imagens é dividida por imagem e as partes
+// são atendidas em paralelo: a primeira pela própria thread que chamou, as
+// demais pelas threads de E/S permanentes de cada imagem. Uma requisição que
+// cabe numa só imagem (como a E/S de metadados, de um bloco) não sai da thread.
+class Striped_Disk : public Disk
+{
+public:
+    static const int DEFAULT_STRIPE = 16;
+
+    Striped_Disk(const std::vector<std::string> &filenames, int nblocks, int stripe = DEFAULT_STRIPE, int block_size = DISK_BLOCK_SIZE);
+    ~Striped_Disk();
+
+    void close();
+
+protected:
+    int do_read(int blocknum, int count, char *data);
+    int do_write(int blocknum, int count, const char *data);
+    int do_zero(int blocknum, int count);
+
+private:
+    // Parte de uma requisição entregue à thread de uma imagem
+    class job
+    {
+    public:
+        bool is_write;
+        int blocknum;
+        int count;
+        char *data;
+        int *result;
+        int *remaining;
+    };
+
+    class member
+    {
+    public:
+        std::string filename;
+        int fd;
+        std::atomic<long> nreads;
+        std::atomic<long> nwrites;
+        std::atomic<long> nrequests;
+        std::thread thread;
+        std::deque<job> queue;
+        std::condition_variable wakeup;
+    };
+
+    int transfer(bool is_write, int blocknum, int count, char *data);
+    int transfer_member(bool is_write, int m, int blocknum, int count, char *data);
+    void worker_loop(int m);
+    void workers_stop();
+
+    std::vector<member *> members;
+    int stripe;
+
+    // Protege as filas das threads de E/S
+    std::mutex mutex;
+    std::condition_variable completed;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Verifica imagens maiores que 4 GiB. Formata uma imagem esparsa de 1310720
+# blocos de 4 KiB (5 GiB) em grupos de 131072 blocos e copia Testes.txt para
+# um arquivo por grupo: cada arquivo novo vai para o grupo mais vazio, então o
+# último fica depois dos primeiros 4 GiB. Em seguida remonta a imagem e
+# confere as cópias.
+# Uso, depois do make: ./teste_imagem_grande.sh [<imagem>]
+# A imagem ocupa algumas centenas de MiB no hospedeiro e é apagada ao final.
+
+IMG=${1:-/tmp/simplefs-grande.img}
+BLOCKS=1310720
+FILES=9
+OUT=$(mktemp -d)
+
+rm -f "$IMG"
+{
+	echo "format 131072 lazy"
+	echo "mount"
+	echo "mkroot"
+	for i in $(seq 1 $FILES); do
+		echo "copyin Testes.txt /t$i"
+	done
+	echo "debug"
+} | ./simplefs "$IMG" $BLOCKS > "$OUT/escrita.txt"
+
+# Maior bloco de dados usado, lido da saída do debug
+LAST=$(grep "direct blocks:" "$OUT/escrita.txt" | tr ' ' '\n' | grep '^[0-9][0-9]*$' | sort -n | tail -1)
+
+{
+	echo "mount"
+	for i in $(seq 1 $FILES); do
+		echo "copyout /t$i $OUT/t$i"
+	done
+} | ./simplefs "$IMG" $BLOCKS > "$OUT/leitura.txt"
+
+STATUS=0
+for i in $(seq 1 $FILES); do
+	if ! cmp -s Testes.txt "$OUT/t$i"; then
+		echo "ERROR: /t$i não confere com Testes.txt"
+		STATUS=1
+	fi
+done
+if [ -z "$LAST" ] || [ "$LAST" -le 1048576 ]; then
+	echo "ERROR: nenhum bloco de dados além dos 4 GiB (maior: $LAST)"
+	STATUS=1
+fi
+if [ $STATUS -eq 0 ]; then
+	echo "ok: $FILES cópias conferem; maior bloco de dados $LAST (byte $((LAST * 4096)))"
+fi
+
+rm -rf "$OUT" "$IMG"
+exit $STATUS